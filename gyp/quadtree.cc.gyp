@@ -7,8 +7,18 @@
       'type': 'static_library',
       'sources': [
         '../src/quadtree.cc',
+        '../src/capi.cc',
+        '../src/transport.cc',
         '../include/quadtree.cc/quadtree.h',
         '../include/quadtree.cc/primitives.h',
+        '../include/quadtree.cc/kernels.h',
+        '../include/quadtree.cc/batch.h',
+        '../include/quadtree.cc/capi.h',
+        '../include/quadtree.cc/lazy.h',
+        '../include/quadtree.cc/lod.h',
+        '../include/quadtree.cc/autotune.h',
+        '../include/quadtree.cc/transport.h',
+        '../include/quadtree.cc/domain.h',
       ],
       'include_dirs': [
           '../include'
@@ -0,0 +1,302 @@
+//
+//  autotune.h
+//  layout++
+//
+//  Picks tree parameters at runtime: the fastest configuration which keeps
+//  force error within a given budget.
+//
+
+#ifndef __autotune_h
+#define __autotune_h
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+
+#include "quadtree.h"
+
+/**
+ * Parameters selected by AutoTuner.
+ */
+struct TuningConfig {
+  double theta = 0.8;
+  size_t buildThreads = 1;  // 1 means serial `insertBodies()`
+  size_t forceThreads = 1;
+  size_t packetSize = 1;    // 1 means one tree walk per body
+};
+
+/**
+ * Builds the tree and computes forces, while tuning its own parameters.
+ *
+ * On the first step theta is selected: exact forces are computed for a small
+ * sample of bodies, and the largest theta with relative error within
+ * `errorBudget` wins. If even exact forces (theta 0) miss the budget,
+ * `isBudgetMet()` reports it. Following steps time alternative build thread counts,
+ * force thread counts and packet sizes, one parameter at a time, keeping the
+ * fastest option of each. Once all options are timed the configuration is
+ * locked. Tuning starts over when the number of bodies or their spread
+ * changes significantly.
+ *
+ * QuadTree leaves always hold a single body, so instead of leaf capacity the
+ * tuner picks packet size of the traversal (see `updatePacketForce()`).
+ */
+template <size_t N, typename Kernel = GravityKernel>
+class AutoTuner {
+  enum Stage { BuildThreads, ForceThreads, PacketSize, Done };
+
+  QuadTree<N, Kernel> tree;
+  Kernel kernel;
+  double gravity;
+  double errorBudget;
+  size_t sampleSize = 32;
+
+  TuningConfig current;
+  Stage stage = Done;
+  std::vector<size_t> options;
+  size_t optionIdx = 0;
+  size_t bestOption = 0;
+  double bestTime = 0;
+  double measuredError = 0;
+  bool needsTheta = true;
+
+  size_t threadOptions[3];
+  size_t tunedCount = 0;
+  double tunedSpread = 0;
+
+  std::vector<Body<N> *> ordered;
+
+  static double getSpread(const std::vector<Body<N> *> &bodies) {
+    if (bodies.empty()) return 0;
+    Vector3<N> min(bodies[0]->pos), max(bodies[0]->pos);
+    for (auto body : bodies) {
+      for (size_t i = 0; i < N; ++i) {
+        if (body->pos.coord[i] < min.coord[i]) min.coord[i] = body->pos.coord[i];
+        if (body->pos.coord[i] > max.coord[i]) max.coord[i] = body->pos.coord[i];
+      }
+    }
+    double spread = 0;
+    for (size_t i = 0; i < N; ++i) {
+      if (max.coord[i] - min.coord[i] > spread) spread = max.coord[i] - min.coord[i];
+    }
+    return spread;
+  }
+
+  static bool changedSignificantly(double was, double now) {
+    if (was == 0) return now != 0;
+    double ratio = now / was;
+    return ratio < 0.5 || ratio > 2;
+  }
+
+  Vector3<N> getExactForce(const Body<N> *source, const std::vector<Body<N> *> &bodies) const {
+    Vector3<N> force;
+    for (auto body : bodies) {
+      if (body == source) continue;
+      Vector3<N> dt = body->pos - source->pos;
+      force.addScaledVector(dt, kernel(gravity, source->mass, body->mass, dt.length()));
+    }
+    return force;
+  }
+
+  /**
+   * Relative error of the tree force over sample of bodies. Tree must be built.
+   */
+  double getSampleError(const std::vector<Body<N> *> &bodies, const std::vector<Vector3<N>> &exact) {
+    double errorSum = 0, exactSum = 0;
+    size_t stride = bodies.size() / exact.size();
+    for (size_t i = 0; i < exact.size(); ++i) {
+      Vector3<N> approximate = tree.getBodyForce(bodies[i * stride]);
+      Vector3<N> diff = approximate - exact[i];
+      double diffLength = diff.length();
+      Vector3<N> exactForce(exact[i]);
+      double exactLength = exactForce.length();
+      errorSum += diffLength * diffLength;
+      exactSum += exactLength * exactLength;
+    }
+    return exactSum == 0 ? 0 : std::sqrt(errorSum / exactSum);
+  }
+
+  bool selectTheta(const std::vector<Body<N> *> &bodies) {
+    // theta 0 opens every node, so the last option is exact up to rounding.
+    static const double thetas[] = { 1.2, 1.0, 0.8, 0.6, 0.4, 0.2, 0.1, 0 };
+    const size_t thetasCount = sizeof(thetas) / sizeof(thetas[0]);
+
+    // Error of a partial tree says nothing about the full one:
+    if (!tree.insertBodies(bodies)) return false;
+    size_t samples = bodies.size() < sampleSize ? bodies.size() : sampleSize;
+    std::vector<Vector3<N>> exact;
+    if (samples > 0) {
+      size_t stride = bodies.size() / samples;
+      for (size_t i = 0; i < samples; ++i) exact.push_back(getExactForce(bodies[i * stride], bodies));
+    }
+
+    for (size_t i = 0; i < thetasCount; ++i) {
+      current.theta = thetas[i];
+      tree.setTheta(current.theta);
+      measuredError = exact.empty() ? 0 : getSampleError(bodies, exact);
+      if (measuredError <= errorBudget) break;
+    }
+    return true;
+  }
+
+  void startStage(Stage nextStage) {
+    stage = nextStage;
+    options.clear();
+    optionIdx = 0;
+    bestTime = HUGE_VAL;
+
+    if (stage == BuildThreads || stage == ForceThreads) {
+      for (auto threads : threadOptions) {
+        if (options.empty() || options.back() != threads) options.push_back(threads);
+      }
+    } else if (stage == PacketSize) {
+      options.push_back(1);
+      options.push_back(4);
+      options.push_back(8);
+    }
+  }
+
+  size_t &stageParameter(TuningConfig &config) {
+    if (stage == BuildThreads) return config.buildThreads;
+    if (stage == ForceThreads) return config.forceThreads;
+    return config.packetSize;
+  }
+
+  void computeForces(Body<N> *const *bodies, size_t count, size_t packetSize) const {
+    typename QuadTree<N, Kernel>::PacketStack stack;
+    if (packetSize == 8) {
+      for (size_t i = 0; i < count; i += 8) tree.template updatePacketForce<8>(bodies + i, count - i, stack);
+    } else if (packetSize == 4) {
+      for (size_t i = 0; i < count; i += 4) tree.template updatePacketForce<4>(bodies + i, count - i, stack);
+    } else {
+      for (size_t i = 0; i < count; ++i) bodies[i]->force.add(tree.getBodyForce(bodies[i]));
+    }
+  }
+
+  bool run(const TuningConfig &config, const std::vector<Body<N> *> &bodies) {
+    tree.setTheta(config.theta);
+    if (!tree.insertBodiesConcurrent(bodies, config.buildThreads)) return false;
+
+    ordered.clear();
+    if (config.packetSize > 1) {
+      // packets work best with spatial neighbors, which are adjacent in the tree:
+      traverse<N>(tree.getRoot(), [&](const QuadTreeNode<N> *node) -> bool {
+        if (node->isLeaf()) ordered.push_back(node->body);
+        return !node->isLeaf();
+      });
+    } else {
+      ordered = bodies;
+    }
+    if (ordered.empty()) return true;
+
+    size_t threadCount = config.forceThreads;
+    if (threadCount < 2) {
+      computeForces(&ordered[0], ordered.size(), config.packetSize);
+      return true;
+    }
+
+    // Every thread gets a chunk which is a multiple of the packet size:
+    size_t chunk = (ordered.size() + threadCount - 1) / threadCount;
+    chunk = (chunk + config.packetSize - 1) / config.packetSize * config.packetSize;
+    std::vector<std::thread> threads;
+    for (size_t start = 0; start < ordered.size(); start += chunk) {
+      size_t count = ordered.size() - start < chunk ? ordered.size() - start : chunk;
+      threads.push_back(std::thread([this, start, count, &config]() {
+        computeForces(&ordered[start], count, config.packetSize);
+      }));
+    }
+    for (auto &thread : threads) thread.join();
+    return true;
+  }
+
+public:
+  AutoTuner(double _gravity, double _errorBudget, const Kernel &_kernel = Kernel(),
+            size_t maxThreads = std::thread::hardware_concurrency()) :
+    tree(_gravity, 0.8, _kernel), kernel(_kernel), gravity(_gravity), errorBudget(_errorBudget) {
+    if (maxThreads < 1) maxThreads = 1;
+    threadOptions[0] = 1;
+    threadOptions[1] = maxThreads / 2 > 1 ? maxThreads / 2 : 1;
+    threadOptions[2] = maxThreads;
+  }
+
+  /**
+   * Builds the tree for `bodies`, and adds tree force to every body.
+   *
+   * Returns false if the tree could not be built (see `insertBodies()`).
+   * Forces are not touched then, and the step does not count for tuning:
+   * the same measurement is repeated on the next step.
+   */
+  bool step(const std::vector<Body<N> *> &bodies) {
+    double spread = getSpread(bodies);
+    bool retune = needsTheta ||
+      changedSignificantly((double)tunedCount, (double)bodies.size()) ||
+      changedSignificantly(tunedSpread, spread);
+
+    if (retune) {
+      if (!selectTheta(bodies)) {
+        needsTheta = true;
+        return false;
+      }
+      tunedCount = bodies.size();
+      tunedSpread = spread;
+      needsTheta = false;
+      startStage(BuildThreads);
+    }
+
+    if (stage == Done) return run(current, bodies);
+
+    TuningConfig candidate = current;
+    stageParameter(candidate) = options[optionIdx];
+
+    auto start = std::chrono::steady_clock::now();
+    if (!run(candidate, bodies)) return false;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (elapsed < bestTime) {
+      bestTime = elapsed;
+      bestOption = options[optionIdx];
+    }
+
+    optionIdx += 1;
+    if (optionIdx == options.size()) {
+      stageParameter(current) = bestOption;
+      startStage((Stage)(stage + 1));
+    }
+    return true;
+  }
+
+  /**
+   * Forces tuning to start over on the next step.
+   */
+  void retune() {
+    needsTheta = true;
+  }
+
+  bool isTuned() const {
+    return !needsTheta && stage == Done;
+  }
+
+  /**
+   * Whether selected theta keeps the sample error within the budget.
+   */
+  bool isBudgetMet() const {
+    return !needsTheta && measuredError <= errorBudget;
+  }
+
+  const TuningConfig &getConfig() const {
+    return current;
+  }
+
+  /**
+   * Relative error of the selected theta, measured on the sample of bodies.
+   */
+  double getMeasuredError() const {
+    return measuredError;
+  }
+
+  QuadTree<N, Kernel> &getTree() {
+    return tree;
+  }
+};
+
+#endif
@@ -0,0 +1,90 @@
+//
+//  batch.h
+//  layout++
+//
+//  Computes forces for bodies stored in caller-owned flat buffers, without
+//  asking caller to create Body<N> for every point.
+//
+
+#ifndef __batch_h
+#define __batch_h
+
+#include <vector>
+
+#include "quadtree.h"
+
+/**
+ * How coordinates are stored in a flat buffer of `count` points:
+ *
+ *  - Interleaved: x0, y0, z0, x1, y1, z1, ...
+ *  - PerAxis:     x0, x1, ..., y0, y1, ..., z0, z1, ...
+ */
+enum class BufferLayout {
+  Interleaved,
+  PerAxis
+};
+
+/**
+ * Evaluates forces for a flat array of positions. Bodies and the tree are
+ * owned by this object and reused between calls, so after the first call
+ * with the largest `count` no memory is allocated.
+ */
+template <size_t N, typename Kernel = GravityKernel>
+class BatchForces {
+  QuadTree<N, Kernel> tree;
+  std::vector<Body<N>> bodies;
+  std::vector<Body<N> *> bodyPointers;
+
+  static size_t offset(BufferLayout layout, size_t count, size_t idx, size_t axis) {
+    return layout == BufferLayout::Interleaved ? idx * N + axis : axis * count + idx;
+  }
+
+public:
+  BatchForces() : BatchForces(-1.2, 0.8) {}
+  BatchForces(const double &gravity, const double &theta, const Kernel &kernel = Kernel()) :
+    tree(gravity, theta, kernel) {}
+
+  /**
+   * Reads `count` points from `positions`, and writes force acting on each of
+   * them into `forces`. Both buffers use the same `layout` and must have room
+   * for `count * N` values. `masses` is optional, when NULL every point has
+   * mass 1.
+   *
+   * Returns false when the tree could not be built because points are too
+   * close to be separated. `forces` is left untouched in that case.
+   */
+  bool compute(const double *positions, size_t count, BufferLayout layout,
+               const double *masses, double *forces) {
+    bodies.resize(count);
+    if (bodyPointers.size() != count || (count > 0 && bodyPointers[0] != &bodies[0])) {
+      bodyPointers.resize(count);
+      for (size_t i = 0; i < count; ++i) bodyPointers[i] = &bodies[i];
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      Body<N> &body = bodies[i];
+      for (size_t axis = 0; axis < N; ++axis) {
+        body.pos.coord[axis] = positions[offset(layout, count, i, axis)];
+      }
+      body.mass = masses ? masses[i] : 1.0;
+      body.force.reset();
+    }
+
+    if (!tree.insertBodies(bodyPointers)) return false;
+
+    for (size_t i = 0; i < count; ++i) {
+      Body<N> &body = bodies[i];
+      tree.updateBodyForce(&body);
+      for (size_t axis = 0; axis < N; ++axis) {
+        forces[offset(layout, count, i, axis)] = body.force.coord[axis];
+      }
+    }
+    return true;
+  }
+
+  QuadTree<N, Kernel> &getTree() {
+    return tree;
+  }
+};
+
+#endif
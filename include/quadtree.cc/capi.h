@@ -0,0 +1,50 @@
+/*
+ *  capi.h
+ *  layout++
+ *
+ *  Stable C interface to BatchForces. Every function is safe to call from C,
+ *  no exception crosses this boundary.
+ */
+
+#ifndef __quadtree_capi_h
+#define __quadtree_capi_h
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct quadtree_batch quadtree_batch;
+
+/* Buffer layouts, see BufferLayout in batch.h */
+#define QUADTREE_LAYOUT_INTERLEAVED 0
+#define QUADTREE_LAYOUT_PER_AXIS 1
+
+/* Status codes */
+#define QUADTREE_OK 0
+#define QUADTREE_INVALID_ARGUMENT -1
+#define QUADTREE_ERROR -2
+
+/*
+ * Creates a force evaluator for 2 or 3 dimensional points. Returns NULL if
+ * dimension is not supported or memory could not be allocated.
+ */
+quadtree_batch *quadtree_batch_create(int dimension, double gravity, double theta);
+
+void quadtree_batch_destroy(quadtree_batch *batch);
+
+/*
+ * Computes forces for `count` points. `positions` and `forces` hold
+ * `count * dimension` values in the given layout. `masses` can be NULL.
+ * Returns QUADTREE_ERROR and leaves `forces` untouched when points are too
+ * close to each other to build the tree.
+ */
+int quadtree_batch_compute(quadtree_batch *batch, const double *positions, size_t count,
+                           int layout, const double *masses, double *forces);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+//
+//  domain.h
+//  layout++
+//
+//  Splits one simulation between several processes. Every process owns a
+//  part of bodies, builds a tree for them, and receives from other processes
+//  only summaries of their trees which it needs ("locally essential tree").
+//
+
+#ifndef __domain_h
+#define __domain_h
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include "quadtree.h"
+#include "transport.h"
+
+/**
+ * Position of `pos` on the Morton (Z-order) curve, within the square which
+ * starts at `min` and has side `side`.
+ */
+template <size_t N>
+uint64_t getMortonKey(const Vector3<N> &pos, const Vector3<N> &min, double side) {
+  const size_t bits = 63 / N;
+  const double cells = (double)((uint64_t(1) << bits) - 1);
+
+  uint64_t key = 0;
+  uint64_t cell[N];
+  for (size_t i = 0; i < N; ++i) {
+    double normalized = side > 0 ? (pos.coord[i] - min.coord[i]) / side : 0;
+    if (normalized < 0) normalized = 0;
+    if (normalized > 1) normalized = 1;
+    cell[i] = (uint64_t)(normalized * cells);
+  }
+  for (size_t bit = bits; bit > 0; --bit) {
+    for (size_t i = 0; i < N; ++i) {
+      key = (key << 1) | ((cell[i] >> (bit - 1)) & 1);
+    }
+  }
+  return key;
+}
+
+/**
+ * Splits bodies into `parts` contiguous ranges of the Morton curve, with
+ * equal number of bodies in each. Returns owner part of every body.
+ */
+template <size_t N>
+std::vector<size_t> partitionBodies(const std::vector<Body<N> *> &bodies, size_t parts) {
+  std::vector<size_t> owners(bodies.size(), 0);
+  if (bodies.empty() || parts < 2) return owners;
+
+  Vector3<N> min(bodies[0]->pos), max(bodies[0]->pos);
+  for (auto body : bodies) {
+    for (size_t i = 0; i < N; ++i) {
+      if (body->pos.coord[i] < min.coord[i]) min.coord[i] = body->pos.coord[i];
+      if (body->pos.coord[i] > max.coord[i]) max.coord[i] = body->pos.coord[i];
+    }
+  }
+  double side = 0;
+  for (size_t i = 0; i < N; ++i) side = std::max(side, max.coord[i] - min.coord[i]);
+
+  std::vector<std::pair<uint64_t, size_t>> keys(bodies.size());
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    keys[i] = std::make_pair(getMortonKey<N>(bodies[i]->pos, min, side), i);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    owners[keys[i].second] = i * parts / keys.size();
+  }
+  return owners;
+}
+
+/**
+ * Computes forces for the bodies owned by this process, taking into account
+ * bodies owned by every other process in `transport`.
+ *
+ * On each step processes share bounding boxes of their bodies. Then every
+ * process walks its own tree for each peer, and sends the top of the tree down
+ * to the coarsest nodes that satisfy the theta criterion for every point of
+ * the peer's box ("locally essential tree"). Each node carries mass, center of
+ * mass and bounds. The receiver walks imported nodes with the usual theta test,
+ * so remote parts of the tree are opened only as deep as each body needs.
+ *
+ * Any partition of bodies gives correct forces, but compact domains (see
+ * `partitionBodies()`) need much less traffic.
+ */
+template <size_t N, typename Kernel = GravityKernel>
+class DomainDecomposition {
+  // Imported node. Nodes are stored in preorder, and `next` points to the
+  // first node after this node's subtree, so the walk needs no stack.
+  struct RemoteNode {
+    double mass;
+    Vector3<N> center;
+    double width;
+    int kind;       // see NodeKind
+    size_t next;
+  };
+
+  enum NodeKind {
+    RemoteBody = -1,    // a single body
+    RemoteSummary = 0,  // accepted for every point of our domain
+    // positive value is number of children that follow the node
+  };
+
+  // First value of the box message:
+  enum BoxStatus {
+    EmptyBox = 0,      // process has no bodies
+    FilledBox = 1,     // bounds of the bodies follow
+    FailedBuild = -1,  // process could not build its tree
+  };
+
+  // mass, center, min bounds, max bounds, kind
+  static const size_t nodeSize = 2 + 3 * N;
+
+  ITransport &transport;
+  QuadTree<N, Kernel> tree;
+  Kernel kernel;
+  double gravity;
+  double theta;
+
+  std::vector<double> outgoing;
+  std::vector<double> incoming;
+  std::vector<RemoteNode> remoteNodes;
+  std::vector<std::vector<double>> peerBoxes;
+
+  void getLocalBox(const std::vector<Body<N> *> &bodies, std::vector<double> &box) const {
+    box.assign(1 + 2 * N, EmptyBox);
+    if (bodies.empty()) return;
+
+    box[0] = FilledBox;
+    for (size_t i = 0; i < N; ++i) box[1 + i] = box[1 + N + i] = bodies[0]->pos.coord[i];
+    for (auto body : bodies) {
+      for (size_t i = 0; i < N; ++i) {
+        box[1 + i] = std::min(box[1 + i], body->pos.coord[i]);
+        box[1 + N + i] = std::max(box[1 + N + i], body->pos.coord[i]);
+      }
+    }
+  }
+
+  static double getDistanceToBox(const Vector3<N> &point, const std::vector<double> &box) {
+    double sum = 0;
+    for (size_t i = 0; i < N; ++i) {
+      double below = box[1 + i] - point.coord[i];
+      double above = point.coord[i] - box[1 + N + i];
+      double d = std::max(0., std::max(below, above));
+      sum += d * d;
+    }
+    return std::sqrt(sum);
+  }
+
+  void appendNode(double mass, const Vector3<N> &center, const Vector3<N> &min, const Vector3<N> &max,
+                  int kind, std::vector<double> &out) const {
+    out.push_back(mass);
+    for (size_t i = 0; i < N; ++i) out.push_back(center.coord[i]);
+    for (size_t i = 0; i < N; ++i) out.push_back(min.coord[i]);
+    for (size_t i = 0; i < N; ++i) out.push_back(max.coord[i]);
+    out.push_back(kind);
+  }
+
+  /**
+   * Writes in preorder nodes of the local tree which are enough to compute
+   * forces anywhere in the peer's `box`.
+   */
+  void collectEssential(const QuadTreeNode<N> *node, const std::vector<double> &box, std::vector<double> &out) {
+    if (node->isLeaf()) {
+      appendNode(node->body->mass, node->body->pos, node->body->pos, node->body->pos, RemoteBody, out);
+      return;
+    }
+
+    Vector3<N> centerOfMass(node->massVector);
+    centerOfMass.multiplyScalar(1./node->mass);
+    double dist = getDistanceToBox(centerOfMass, box);
+    double regionWidth = node->maxBounds.coord[0] - node->minBounds.coord[0];
+    if (dist > 0 && regionWidth / dist < theta) {
+      appendNode(node->mass, centerOfMass, node->minBounds, node->maxBounds, RemoteSummary, out);
+      return;
+    }
+
+    int children = 0;
+    for (auto child : node->quads) {
+      if (child) children += 1;
+    }
+    appendNode(node->mass, centerOfMass, node->minBounds, node->maxBounds, children, out);
+    for (auto child : node->quads) {
+      if (child) collectEssential(child, box, out);
+    }
+  }
+
+  /**
+   * Decodes subtree which starts at `offset` of `message` into `remoteNodes`.
+   * Returns offset right after the subtree.
+   */
+  size_t importSubtree(const std::vector<double> &message, size_t offset) {
+    if (offset + nodeSize > message.size()) throw TransportException();
+
+    size_t idx = remoteNodes.size();
+    remoteNodes.resize(idx + 1);
+    RemoteNode &node = remoteNodes[idx];
+    node.mass = message[offset];
+    for (size_t i = 0; i < N; ++i) node.center.coord[i] = message[offset + 1 + i];
+    node.width = message[offset + 1 + 2 * N] - message[offset + 1 + N];
+    node.kind = (int)message[offset + 1 + 3 * N];
+    offset += nodeSize;
+
+    // Children grow `remoteNodes`, so `node` must not be used below.
+    int children = node.kind;
+    for (int child = 0; child < children; ++child) offset = importSubtree(message, offset);
+    remoteNodes[idx].next = remoteNodes.size();
+    return offset;
+  }
+
+  Vector3<N> getRemoteForce(const Body<N> *body) const {
+    Vector3<N> force;
+    size_t i = 0;
+    while (i < remoteNodes.size()) {
+      const RemoteNode &node = remoteNodes[i];
+      Vector3<N> dt(node.center);
+      dt.sub(body->pos);
+      double dist = dt.length();
+
+      if (node.kind == RemoteBody) {
+        force.addScaledVector(dt, kernel(gravity, body->mass, node.mass, dist));
+        i = node.next;
+        continue;
+      }
+
+      double openingDistance = clampDistance(dist);
+      if (node.kind == RemoteSummary || node.width / openingDistance < theta) {
+        force.addScaledVector(dt, kernel(gravity, body->mass, node.mass, dist));
+        i = node.next;
+      } else {
+        i += 1; // open the node
+      }
+    }
+    return force;
+  }
+
+public:
+  DomainDecomposition(ITransport &_transport, double _gravity, double _theta, const Kernel &_kernel = Kernel()) :
+    transport(_transport), tree(_gravity, _theta, _kernel), kernel(_kernel), gravity(_gravity), theta(_theta) {}
+
+  /**
+   * Adds force to every body in `localBodies`. Must be called by all
+   * processes of the transport on the same iteration.
+   *
+   * Returns false if any process could not build its tree (see
+   * `insertBodies()`). Build status travels with the bounding boxes, so every
+   * process returns false on the same step, and no forces are touched.
+   */
+  bool step(const std::vector<Body<N> *> &localBodies) {
+    size_t rank = transport.getRank();
+    size_t size = transport.getSize();
+
+    bool built = tree.insertBodies(localBodies);
+
+    std::vector<double> localBox;
+    getLocalBox(localBodies, localBox);
+    if (!built) localBox[0] = FailedBuild;
+    peerBoxes.resize(size);
+    for (size_t peer = 0; peer < size; ++peer) {
+      if (peer != rank) transport.exchange(peer, localBox, peerBoxes[peer]);
+    }
+
+    // Partial tree would give peers wrong summaries:
+    if (!built) return false;
+    for (size_t peer = 0; peer < size; ++peer) {
+      if (peer != rank && peerBoxes[peer][0] == FailedBuild) return false;
+    }
+
+    remoteNodes.clear();
+    for (size_t peer = 0; peer < size; ++peer) {
+      if (peer == rank) continue;
+
+      outgoing.clear();
+      if (!localBodies.empty() && peerBoxes[peer][0] == FilledBox) collectEssential(tree.getRoot(), peerBoxes[peer], outgoing);
+      transport.exchange(peer, outgoing, incoming);
+      if (!incoming.empty()) importSubtree(incoming, 0);
+    }
+
+    for (auto body : localBodies) {
+      tree.updateBodyForce(body);
+      body->force.add(getRemoteForce(body));
+    }
+    return true;
+  }
+
+  /**
+   * Number of nodes received from other processes on the last step.
+   */
+  size_t getEssentialCount() const {
+    return remoteNodes.size();
+  }
+};
+
+#endif
@@ -0,0 +1,167 @@
+//
+//  kernels.h
+//  layout++
+//
+//  Force kernels used by QuadTree to compute interaction between two masses.
+//
+//  A kernel is any type with a const member
+//
+//    double operator()(double gravity, double sourceMass, double otherMass, double dist) const
+//
+//  which returns a coefficient `v`, so that the force on the source is
+//  `v * (otherPos - sourcePos)`. Thus for a force of magnitude F(r) the kernel
+//  should return F(r) / r. `dist` is the real distance to the mass, it is 0 when
+//  a body shares the spot with another body or with a node's center of mass.
+//  Kernel is responsible to keep the result finite.
+//
+//  Kernels are passed as template arguments and called directly, so the compiler
+//  inlines them into the tree traversal. Packet traversal calls the kernel for
+//  every lane and vectorizes it, as long as the kernel has no branches (see
+//  `clampDistance()`).
+//
+//  LazyForces additionally needs
+//
+//    double maxChange(double gravity, double sourceMass, double otherMass,
+//                     double dist, double displacement) const
+//
+//  which returns an upper bound of how much the force on the source can change
+//  when the other mass, now at `dist`, has moved by `displacement`.
+//
+
+#ifndef __kernels_h
+#define __kernels_h
+
+#include <cmath>
+
+/**
+ * Distance which singular kernels use instead of 0.
+ */
+const double kMinDistance = 0.1;
+
+/**
+ * Returns `dist`, or `kMinDistance` when it is 0. Adds instead of selecting,
+ * so that compiler keeps lane loops free of branches and can vectorize them.
+ */
+inline double clampDistance(double dist) {
+  return dist + (dist == 0 ? kMinDistance : 0);
+}
+
+/**
+ * Smallest distance the other mass could have been at, before it moved by
+ * `displacement`. Never below `floor`.
+ */
+inline double getClosestDistance(double dist, double displacement, double floor) {
+  double closest = dist - displacement;
+  return closest < floor ? floor : closest;
+}
+
+/**
+ * Classic inverse-square gravity: F = G * m1 * m2 / r^2. This is what QuadTree
+ * used before kernels were configurable.
+ */
+struct GravityKernel {
+  inline double operator()(double gravity, double sourceMass, double otherMass, double dist) const {
+    dist = clampDistance(dist);
+    return gravity * sourceMass * otherMass / (dist * dist * dist);
+  }
+
+  // |dF/dx| <= 2 * G * m1 * m2 / r^3
+  inline double maxChange(double gravity, double sourceMass, double otherMass, double dist, double displacement) const {
+    double r = getClosestDistance(dist, displacement, kMinDistance);
+    return 2 * std::abs(gravity) * sourceMass * otherMass * displacement / (r * r * r);
+  }
+};
+
+/**
+ * Plummer-softened gravity: F = G * m1 * m2 * r / (r^2 + eps^2)^(3/2).
+ * Stays finite for coinciding bodies, and does not blow up for very close ones.
+ */
+struct SoftenedGravityKernel {
+  double epsilonSquared;
+
+  SoftenedGravityKernel() : SoftenedGravityKernel(1.0) {}
+  SoftenedGravityKernel(double epsilon) : epsilonSquared(epsilon * epsilon) {}
+
+  inline double operator()(double gravity, double sourceMass, double otherMass, double dist) const {
+    double d2 = dist * dist + epsilonSquared;
+    return gravity * sourceMass * otherMass / (d2 * std::sqrt(d2));
+  }
+
+  // |dF/dx| <= 2 * G * m1 * m2 / (r^2 + eps^2)^(3/2)
+  inline double maxChange(double gravity, double sourceMass, double otherMass, double dist, double displacement) const {
+    double r = getClosestDistance(dist, displacement, 0);
+    double d2 = r * r + epsilonSquared;
+    return 2 * std::abs(gravity) * sourceMass * otherMass * displacement / (d2 * std::sqrt(d2));
+  }
+};
+
+/**
+ * Inverse-square gravity which is ignored beyond `cutoff` distance.
+ */
+struct CutoffGravityKernel {
+  double cutoff;
+
+  CutoffGravityKernel() : CutoffGravityKernel(1000.0) {}
+  CutoffGravityKernel(double _cutoff) : cutoff(_cutoff) {}
+
+  inline double operator()(double gravity, double sourceMass, double otherMass, double dist) const {
+    // Dividing by infinity instead of returning 0 keeps the kernel free of branches.
+    double r = clampDistance(dist) + (dist > cutoff ? HUGE_VAL : 0);
+    return gravity * sourceMass * otherMass / (r * r * r);
+  }
+
+  // Same as gravity within the cutoff, plus a jump when the mass crossed it.
+  inline double maxChange(double gravity, double sourceMass, double otherMass, double dist, double displacement) const {
+    double r = getClosestDistance(dist, displacement, kMinDistance);
+    if (r > cutoff) return 0;
+
+    double strength = std::abs(gravity) * sourceMass * otherMass;
+    double change = 2 * strength * displacement / (r * r * r);
+    if (dist + displacement > cutoff) change += strength / (cutoff * cutoff);
+    return change;
+  }
+};
+
+/**
+ * Logarithmic potential, F = G * m1 * m2 / r. This is repulsion used by
+ * LinLog-style layouts, it produces better separated clusters.
+ */
+struct LogKernel {
+  inline double operator()(double gravity, double sourceMass, double otherMass, double dist) const {
+    dist = clampDistance(dist);
+    return gravity * sourceMass * otherMass / (dist * dist);
+  }
+
+  // |dF/dx| <= G * m1 * m2 / r^2
+  inline double maxChange(double gravity, double sourceMass, double otherMass, double dist, double displacement) const {
+    double r = getClosestDistance(dist, displacement, kMinDistance);
+    return std::abs(gravity) * sourceMass * otherMass * displacement / (r * r);
+  }
+};
+
+/**
+ * Yukawa (screened) interaction: F = G * m1 * m2 * (1 + r / lambda) * e^(-r / lambda) / r^2.
+ * Behaves as gravity on short distances, and quickly fades beyond `lambda`.
+ */
+struct YukawaKernel {
+  double inverseLambda;
+
+  YukawaKernel() : YukawaKernel(100.0) {}
+  YukawaKernel(double lambda) : inverseLambda(1.0 / lambda) {}
+
+  inline double operator()(double gravity, double sourceMass, double otherMass, double dist) const {
+    dist = clampDistance(dist);
+    double scaled = dist * inverseLambda;
+    return gravity * sourceMass * otherMass * (1 + scaled) * std::exp(-scaled) / (dist * dist * dist);
+  }
+
+  // |dF/dx| <= G * m1 * m2 * (x^2 + 2x + 2) * e^(-x) / r^3, where x = r / lambda
+  inline double maxChange(double gravity, double sourceMass, double otherMass, double dist, double displacement) const {
+    double r = getClosestDistance(dist, displacement, kMinDistance);
+    double scaled = r * inverseLambda;
+    return std::abs(gravity) * sourceMass * otherMass * displacement *
+      (scaled * scaled + 2 * scaled + 2) * std::exp(-scaled) / (r * r * r);
+  }
+};
+
+#endif
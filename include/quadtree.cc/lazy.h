@@ -0,0 +1,266 @@
+//
+//  lazy.h
+//  layout++
+//
+//  Reuses previously computed forces for bodies whose surroundings did not
+//  change enough since the last evaluation.
+//
+
+#ifndef __lazy_h
+#define __lazy_h
+
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+#include <algorithm>
+
+#include "quadtree.h"
+
+/**
+ * Keeps a cached tree force per body and recomputes it only when the cache
+ * becomes stale. A cache is stale when:
+ *
+ *  - the body itself moved further than `positionTolerance` since its force
+ *    was computed, or
+ *  - bound of how much other moving bodies could change the body's tree force,
+ *    accumulated since the last computation, exceeds `forceTolerance`.
+ *
+ * The bound covers both the motion itself and the change of approximation it
+ * causes: a moving body shifts center of mass of every node it touches, may
+ * move mass from one node to another, and may flip the opening test of a node.
+ * Nodes record this motion (see QuadTreeNode), and each term is bounded by
+ * the kernel's `maxChange()` (see kernels.h). Nodes which no body touched have
+ * the same contribution as before, so the estimate does not descend there.
+ *
+ * This relies on nodes keeping their bounds between builds. When the root's
+ * bounds change (a body on the edge of the layout moved), every cache is
+ * dropped.
+ *
+ * This saves force evaluations, not bookkeeping: every update still makes a
+ * few O(n) passes (displacements, clearing node motion), and caller rebuilds
+ * the tree. The staleness check walks only nodes touched by moving bodies, so
+ * it is O(1) per body when nothing moved, and as slow as a force evaluation
+ * when everything did.
+ */
+template <size_t N, typename Kernel = GravityKernel>
+class LazyForces {
+  QuadTree<N, Kernel> &tree;
+  double positionTolerance;
+  double forceTolerance;
+
+  std::vector<Body<N> *> knownBodies;
+  std::unordered_map<const Body<N> *, size_t> bodyIndex;
+
+  std::vector<Vector3<N>> cachedForce;
+  std::vector<Vector3<N>> evaluatedPos; // position of the body when its force was computed
+  std::vector<Vector3<N>> previousPos;  // position of the body on the previous update
+  std::vector<double> step;             // how far body moved since previous update
+  std::vector<double> staleness;        // accumulated force change estimate
+  Vector3<N> rootMin, rootMax;          // root bounds on the previous update
+
+  size_t recomputedCount = 0;
+
+  void track(const std::vector<Body<N> *> &bodies) {
+    knownBodies = bodies;
+    size_t count = bodies.size();
+    bodyIndex.clear();
+    cachedForce.resize(count);
+    evaluatedPos.resize(count);
+    previousPos.resize(count);
+    step.resize(count);
+    staleness.resize(count);
+
+    for (size_t i = 0; i < count; ++i) {
+      bodyIndex[bodies[i]] = i;
+      previousPos[i] = bodies[i]->pos;
+      staleness[i] = HUGE_VAL; // never computed
+    }
+  }
+
+  bool boundsChanged() {
+    auto root = tree.getRoot();
+    bool changed = !(root->minBounds == rootMin) || !(root->maxBounds == rootMax);
+    rootMin = root->minBounds;
+    rootMax = root->maxBounds;
+    return changed;
+  }
+
+  void clearMotion(QuadTreeNode<N> *node) {
+    node->drift = node->movedMoment = node->crossingMass = node->orphanMass = 0;
+    for (auto child : node->quads) {
+      if (child) clearMotion(child);
+    }
+  }
+
+  /**
+   * Records motion of a body from `from` to its current position in every node
+   * it touches.
+   */
+  void recordMotion(const Body<N> *body, const Vector3<N> &from, double displacement) {
+    double moment = body->mass * displacement;
+    Vector3<N> quadMin, quadMax;
+
+    // Nodes which have both positions:
+    QuadTreeNode<N> *node = tree.getRoot();
+    int to, back;
+    while (true) {
+      node->drift = std::max(node->drift, displacement);
+      node->movedMoment += moment;
+      if (node->isLeaf()) return;
+
+      to = tree.getQuadrant(node, body->pos, quadMin, quadMax);
+      back = tree.getQuadrant(node, from, quadMin, quadMax);
+      if (to != back || !node->quads[to]) break;
+      node = node->quads[to];
+    }
+
+    // Below that, two paths are crossed by the body:
+    recordCrossing(node, node->quads[to], body->pos, body->mass, displacement);
+    recordCrossing(node, node->quads[back], from, body->mass, displacement);
+  }
+
+  void recordCrossing(QuadTreeNode<N> *parent, QuadTreeNode<N> *node, const Vector3<N> &pos,
+                      double mass, double displacement) {
+    Vector3<N> quadMin, quadMax;
+    while (node) {
+      node->drift = std::max(node->drift, displacement);
+      node->crossingMass += mass;
+      if (node->isLeaf()) return;
+
+      parent = node;
+      node = node->quads[tree.getQuadrant(node, pos, quadMin, quadMax)];
+    }
+    // The body left a quadrant which is empty now:
+    parent->orphanMass += mass;
+  }
+
+  double estimateChange(const Body<N> *sourceBody) {
+    double change = 0;
+    double gravity = tree.getGravity();
+    double theta = tree.getTheta();
+    const Kernel &kernel = tree.getKernel();
+    double sourceMass = sourceBody->mass;
+
+    auto isAccepted = [&](double regionWidth, double dist) -> bool {
+      return regionWidth / (dist <= 0 ? kMinDistance : dist) < theta;
+    };
+
+    traverse<N>(tree.getRoot(), [&](const QuadTreeNode<N> *node) -> bool {
+      if (node->drift == 0) return false; // nothing touched this node
+      if (node->body == sourceBody && node->crossingMass == 0) return false;
+
+      Vector3<N> center;
+      double mass;
+      if (node->isLeaf()) {
+        center.set(node->body->pos);
+        mass = node->body->mass;
+      } else {
+        center.set(node->massVector);
+        center.multiplyScalar(1./node->mass);
+        mass = node->mass;
+      }
+      Vector3<N> dt = center - sourceBody->pos;
+      auto dist = dt.length();
+
+      auto regionWidth = node->maxBounds.coord[0] - node->minBounds.coord[0];
+      auto diagonal = regionWidth * std::sqrt((double)N); // no body is further than that from the center
+
+      // How far the center of mass could have moved since the previous build:
+      auto stayedMass = mass - node->crossingMass;
+      auto shift = diagonal;
+      if (stayedMass > 0) {
+        shift = std::min(diagonal, (node->movedMoment + node->crossingMass * diagonal) / stayedMass);
+      }
+
+      // Leaf is exact, unless it was part of a bigger node before.
+      bool accepted = node->isLeaf() || isAccepted(regionWidth, dist);
+      bool mayFlip = node->isLeaf() ? node->crossingMass > 0 :
+        isAccepted(regionWidth, dist - shift) != isAccepted(regionWidth, dist + shift);
+
+      if (!accepted && !mayFlip) {
+        // Opened now and before: children tell the rest, except for mass
+        // which left through a quadrant that is gone now.
+        if (node->orphanMass > 0) {
+          change += kernel.maxChange(gravity, sourceMass, node->orphanMass, dist, diagonal + node->drift);
+        }
+        return true;
+      }
+
+      // Center of mass moved:
+      change += kernel.maxChange(gravity, sourceMass, mass, dist, shift);
+      // Mass moved in or out, and is represented by a different node now:
+      auto movedMass = node->crossingMass + node->orphanMass;
+      if (movedMass > 0) {
+        change += kernel.maxChange(gravity, sourceMass, movedMass, dist, diagonal + node->drift + shift);
+      }
+      // Opening test may have had another outcome, so approximation error of
+      // the node counts twice: before and now.
+      if (mayFlip) {
+        change += 2 * kernel.maxChange(gravity, sourceMass, mass + node->crossingMass, dist, diagonal + shift);
+      }
+      return false;
+    });
+
+    return change;
+  }
+
+public:
+  LazyForces(QuadTree<N, Kernel> &_tree, double _positionTolerance, double _forceTolerance) :
+    tree(_tree), positionTolerance(_positionTolerance), forceTolerance(_forceTolerance) {}
+
+  /**
+   * Adds tree force to every body in `bodies`. The tree must already contain
+   * current positions of the same bodies (i.e. `insertBodies(bodies)` was
+   * called). Changing the set of bodies drops all cached forces.
+   */
+  void update(const std::vector<Body<N> *> &bodies) {
+    if (bodies != knownBodies) track(bodies);
+
+    size_t count = bodies.size();
+    for (size_t i = 0; i < count; ++i) {
+      step[i] = (bodies[i]->pos - previousPos[i]).length();
+    }
+
+    auto root = tree.getRoot();
+    if (root && count > 0) {
+      if (boundsChanged()) {
+        for (size_t i = 0; i < count; ++i) staleness[i] = HUGE_VAL;
+      }
+      clearMotion(root);
+      for (size_t i = 0; i < count; ++i) {
+        if (step[i] > 0) recordMotion(bodies[i], previousPos[i], step[i]);
+        previousPos[i] = bodies[i]->pos;
+      }
+    }
+
+    recomputedCount = 0;
+    for (size_t i = 0; i < count; ++i) {
+      Body<N> *body = bodies[i];
+      bool dirty = staleness[i] > forceTolerance ||
+        (body->pos - evaluatedPos[i]).length() > positionTolerance;
+
+      if (!dirty) {
+        staleness[i] += estimateChange(body);
+        dirty = staleness[i] > forceTolerance;
+      }
+
+      if (dirty) {
+        cachedForce[i] = tree.getBodyForce(body);
+        evaluatedPos[i] = body->pos;
+        staleness[i] = 0;
+        recomputedCount += 1;
+      }
+
+      body->force.add(cachedForce[i]);
+    }
+  }
+
+  /**
+   * Number of bodies whose force was recomputed by the last `update()`.
+   */
+  size_t getRecomputedCount() const {
+    return recomputedCount;
+  }
+};
+
+#endif
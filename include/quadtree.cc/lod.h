@@ -0,0 +1,162 @@
+//
+//  lod.h
+//  layout++
+//
+//  Level-of-detail extraction: cuts the tree into clusters which are small
+//  enough on the screen, so that renderer can draw one mark per cluster.
+//
+
+#ifndef __lod_h
+#define __lod_h
+
+#include <vector>
+
+#include "quadtree.h"
+
+/**
+ * Aggregated subtree of a QuadTree.
+ */
+template <size_t N>
+struct Cluster {
+  Vector3<N> center;     // center of mass
+  Vector3<N> minBounds;
+  Vector3<N> maxBounds;
+  double mass;
+  size_t bodyCount;
+};
+
+/**
+ * Extracts tree cuts for a view box. A node becomes a cluster when it is a
+ * leaf, or when its side, measured in pixels, is smaller than `minPixelSize`.
+ * Nodes outside of the view box are skipped.
+ *
+ * Results and traversal stack are kept between calls, so extraction does not
+ * allocate once buffers have grown to the working size. Since the cut depends
+ * only on scale, panning at the same scale over the same tree is incremental:
+ * clusters from the previous frame are kept, and only the newly exposed part
+ * of the view is walked.
+ */
+template <size_t N, typename Kernel = GravityKernel>
+class LevelOfDetail {
+  QuadTree<N, Kernel> &tree;
+
+  std::vector<Cluster<N>> clusters;
+  std::vector<const QuadTreeNode<N> *> stack;
+
+  bool hasPrevious = false;
+  size_t previousVersion = 0;
+  double previousScale = 0;
+  double previousMinPixelSize = 0;
+  Vector3<N> previousMin, previousMax;
+
+  static bool intersects(const Vector3<N> &aMin, const Vector3<N> &aMax,
+                         const Vector3<N> &bMin, const Vector3<N> &bMax) {
+    for (size_t i = 0; i < N; ++i) {
+      if (aMax.coord[i] < bMin.coord[i] || aMin.coord[i] > bMax.coord[i]) return false;
+    }
+    return true;
+  }
+
+  static bool contains(const Vector3<N> &outerMin, const Vector3<N> &outerMax,
+                       const Vector3<N> &innerMin, const Vector3<N> &innerMax) {
+    for (size_t i = 0; i < N; ++i) {
+      if (innerMin.coord[i] < outerMin.coord[i] || innerMax.coord[i] > outerMax.coord[i]) return false;
+    }
+    return true;
+  }
+
+  void emit(const QuadTreeNode<N> *node) {
+    clusters.resize(clusters.size() + 1);
+    Cluster<N> &cluster = clusters.back();
+    cluster.minBounds.set(node->minBounds);
+    cluster.maxBounds.set(node->maxBounds);
+    if (node->isLeaf()) {
+      cluster.center.set(node->body->pos);
+      cluster.mass = node->body->mass;
+      cluster.bodyCount = 1;
+    } else {
+      cluster.center.set(node->massVector);
+      cluster.center.multiplyScalar(1./node->mass);
+      cluster.mass = node->mass;
+      cluster.bodyCount = node->bodyCount;
+    }
+  }
+
+  /**
+   * Walks the tree within view box. When `skipPrevious` is set, subtrees which
+   * were entirely visible in the previous frame are not visited, and clusters
+   * that were visible in the previous frame are not emitted again.
+   */
+  void walk(const Vector3<N> &viewMin, const Vector3<N> &viewMax, double scale,
+            double minPixelSize, bool skipPrevious) {
+    stack.clear();
+    stack.push_back(tree.getRoot());
+
+    while (!stack.empty()) {
+      const QuadTreeNode<N> *node = stack.back();
+      stack.pop_back();
+
+      if (!intersects(node->minBounds, node->maxBounds, viewMin, viewMax)) continue;
+      if (skipPrevious && contains(previousMin, previousMax, node->minBounds, node->maxBounds)) continue;
+
+      double side = (node->maxBounds.coord[0] - node->minBounds.coord[0]) * scale;
+      if (node->isLeaf() || side < minPixelSize) {
+        if (!skipPrevious || !intersects(node->minBounds, node->maxBounds, previousMin, previousMax)) {
+          emit(node);
+        }
+        continue;
+      }
+
+      for (size_t i = node->quads.size(); i > 0; --i) {
+        if (node->quads[i - 1]) stack.push_back(node->quads[i - 1]);
+      }
+    }
+  }
+
+public:
+  LevelOfDetail(QuadTree<N, Kernel> &_tree) : tree(_tree) {}
+
+  /**
+   * Returns clusters visible in the [viewMin, viewMax] box. `pixelsPerUnit`
+   * is the current zoom level. The returned reference stays valid until the
+   * next call.
+   */
+  const std::vector<Cluster<N>> &extract(const Vector3<N> &viewMin, const Vector3<N> &viewMax,
+                                         double pixelsPerUnit, double minPixelSize) {
+    bool sameCut = hasPrevious && previousVersion == tree.getVersion() &&
+      previousScale == pixelsPerUnit && previousMinPixelSize == minPixelSize;
+
+    if (!tree.getRoot()) {
+      clusters.clear();
+      hasPrevious = false;
+      return clusters;
+    }
+
+    if (sameCut) {
+      // Drop clusters that scrolled out of the view, keep the rest:
+      size_t kept = 0;
+      for (size_t i = 0; i < clusters.size(); ++i) {
+        if (intersects(clusters[i].minBounds, clusters[i].maxBounds, viewMin, viewMax)) {
+          if (kept != i) clusters[kept] = clusters[i];
+          kept += 1;
+        }
+      }
+      clusters.resize(kept);
+    } else {
+      clusters.clear();
+    }
+
+    walk(viewMin, viewMax, pixelsPerUnit, minPixelSize, sameCut);
+
+    hasPrevious = true;
+    previousVersion = tree.getVersion();
+    previousScale = pixelsPerUnit;
+    previousMinPixelSize = minPixelSize;
+    previousMin.set(viewMin);
+    previousMax.set(viewMax);
+
+    return clusters;
+  }
+};
+
+#endif
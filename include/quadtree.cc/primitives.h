@@ -337,5 +337,6 @@ struct Vector3<2> : public IVector {
 
 
 class NotEnoughQuadSpaceException: public exception {};
+class OutOfTreeBoundsException: public exception {};
 
 #endif
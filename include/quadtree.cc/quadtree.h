@@ -13,8 +13,12 @@
 #include <cmath>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 #include "primitives.h"
+#include "kernels.h"
 #include "random.cc/random.h"
 
 /**
@@ -61,8 +65,18 @@ struct QuadTreeNode : public IQuadTreeNode {
   Vector3<N> minBounds;    // "left" bounds of the node.
   Vector3<N> maxBounds;    // "right" bounds of the node.
 
+  size_t bodyCount;   // Number of bodies in this subtree. Leaves keep it zero, like the mass.
 
-  QuadTreeNode() : quads(1 << N) {}
+  // Motion since the previous build, maintained by LazyForces. A body touches
+  // the node if its previous or current position is inside the node's bounds.
+  double drift;        // Largest displacement of a body which touches the node.
+  double movedMoment;  // Sum of mass * displacement of bodies which stayed in the node.
+  double crossingMass; // Mass of bodies which entered or left the node.
+  double orphanMass;   // Mass which left a quadrant of this node that is now empty.
+
+  QuadTreeNode() : quads(1 << N) {
+    reset();
+  }
   ~QuadTreeNode() {}
 
   void reset() {
@@ -70,6 +84,11 @@ struct QuadTreeNode : public IQuadTreeNode {
     body = NULL;
     massVector.reset();
     mass = 0;
+    bodyCount = 0;
+    drift = 0;
+    movedMoment = 0;
+    crossingMass = 0;
+    orphanMass = 0;
     minBounds.set(0);
     maxBounds.set(0);
   }
@@ -137,6 +156,14 @@ public:
     currentAvailable += 1;
     return result;
   }
+
+  /**
+   * Returns the most recent node obtained by `get()` back to the pool. Only
+   * valid when that node was never linked into the tree.
+   */
+  void unget() {
+    currentAvailable -= 1;
+  }
 };
 
 class IQuadTree {
@@ -144,14 +171,35 @@ public:
   virtual IQuadTreeNode* getRoot() = 0;
 };
 
-template<size_t N>
+/**
+ * `Kernel` computes interaction between two masses, see kernels.h for
+ * available options and requirements.
+ */
+template<size_t N, typename Kernel = GravityKernel>
 class QuadTree : public IQuadTree {
   Random random;
   double _theta;
   double _gravity;
+  Kernel _kernel;
 
   NodePool<N> treeNodes;
-  QuadTreeNode<N> *root;
+  QuadTreeNode<N> *root = NULL;
+  size_t version = 0; // incremented every time the tree is rebuilt
+
+public:
+  // Nodes which are yet to be visited by a packet walk, with the mask of lanes
+  // that need them.
+  typedef std::vector<std::pair<const QuadTreeNode<N> *, unsigned>> PacketStack;
+
+private:
+  std::vector<Body<N> *> packetBodies; // bodies in tree order, used by updateForcesInPackets()
+  PacketStack packetStack;
+
+  // Concurrent insertion gives every producer its own node pool and random
+  // generator. The only shared mutable state are child slots, which are
+  // claimed with compare-and-swap.
+  std::vector<std::unique_ptr<NodePool<N>>> threadNodes;
+  std::vector<std::unique_ptr<Random>> threadRandom;
 
   QuadTreeNode<N> *createRootNode(const std::vector<Body<N> *> &bodies) {
     QuadTreeNode<N> *root = treeNodes.get();
@@ -169,7 +217,15 @@ class QuadTree : public IQuadTree {
       }
     }
 
-    // squarify bounds:
+    squarify(root, bodies.size());
+    return root;
+  }
+
+  void squarify(QuadTreeNode<N> *root, size_t bodiesCount) {
+    Vector3<N> &min = root->minBounds;
+    Vector3<N> &max = root->maxBounds;
+    const int size = N;
+
     double maxSide = 0;
     for (int i = 0; i < size; ++i) {
       double side = max.coord[i] - min.coord[i];
@@ -177,7 +233,7 @@ class QuadTree : public IQuadTree {
     }
 
     if (maxSide == 0) {
-      maxSide = bodies.size() * 500;
+      maxSide = bodiesCount * 500;
       for (int i = 0; i < size; ++i) {
         min.coord[i] -= maxSide;
         max.coord[i] += maxSide;
@@ -185,9 +241,8 @@ class QuadTree : public IQuadTree {
     } else {
       for (int i = 0; i < size; ++i) max.coord[i] = min.coord[i] + maxSide;
     }
-    
-    return root;
   }
+
   void insert(Body<N> *body, QuadTreeNode<N> *node) {
     if (node->isLeaf()) {
       // We are trying to add to the leaf node.
@@ -228,22 +283,13 @@ class QuadTree : public IQuadTree {
       // This is internal node. Update the total mass of the node and center-of-mass.
       Vector3<N>& pos = body->pos;
       node->mass += body->mass;
+      node->bodyCount += 1;
       node->massVector.addScaledVector(pos, body->mass);
 
       // Recursively insert the body in the appropriate quadrant.
       // But first find the appropriate quadrant.
-      int quadIdx = 0; // Assume we are in the 0's quad.
-      Vector3<N> tempMin(node->minBounds), tempMax;
-      tempMax.setMedian(node->minBounds, node->maxBounds);
-
-      for (size_t i = 0; i < N; ++i) {
-        if (pos.coord[i] > tempMax.coord[i]) {
-          quadIdx += (1 << i);
-          auto oldLeft = tempMin.coord[i];
-          tempMin.coord[i] = tempMax.coord[i];
-          tempMax.coord[i] = tempMax.coord[i] + (tempMax.coord[i] - oldLeft);
-        }
-      }
+      Vector3<N> tempMin, tempMax;
+      int quadIdx = getQuadrant(node, pos, tempMin, tempMax);
 
       QuadTreeNode<N> *child = node->quads[quadIdx];
       if (child) {
@@ -260,11 +306,123 @@ class QuadTree : public IQuadTree {
     }
   }
 
+  /**
+   * Lock-free counterpart of `insert()`. Published nodes are never modified,
+   * except for their child slots: a leaf is split by building a replacement
+   * internal node privately and swapping it into the parent's slot. Mass
+   * and center of mass are left for `summarize()`.
+   */
+  void insertConcurrent(Body<N> *body, QuadTreeNode<N> *node, NodePool<N> &pool, Random &rnd) {
+    Vector3<N> quadMin, quadMax;
+    while (true) {
+      int quadIdx = getQuadrant(node, body->pos, quadMin, quadMax);
+      QuadTreeNode<N> **slot = &node->quads[quadIdx];
+      QuadTreeNode<N> *child = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+      if (!child) {
+        QuadTreeNode<N> *leaf = pool.get();
+        leaf->minBounds.set(quadMin);
+        leaf->maxBounds.set(quadMax);
+        leaf->body = body;
+        if (__atomic_compare_exchange_n(slot, &child, leaf, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          return;
+        }
+        // Somebody took this quadrant before us. Try again with what they put there.
+        pool.unget();
+        continue;
+      }
+
+      if (!child->isLeaf()) {
+        node = child;
+        continue;
+      }
+
+      Body<N> *oldBody = child->body;
+      if (oldBody->pos.sameAs(body->pos)) {
+        // Old body may be read by other threads, so we bump the new one.
+        // It is not visible to anyone yet.
+        int retriesCount = 3;
+        do {
+          Vector3<N> diff = child->maxBounds - child->minBounds;
+          diff.multiplyScalar(rnd.nextDouble())->add(child->minBounds);
+          body->pos.set(diff);
+          retriesCount -= 1;
+        } while (retriesCount > 0 && oldBody->pos.sameAs(body->pos));
+
+        if (oldBody->pos.sameAs(body->pos)) {
+          NotEnoughQuadSpaceException  _NotEnoughQuadSpaceException;
+          throw _NotEnoughQuadSpaceException;
+        }
+      }
+
+      QuadTreeNode<N> *internal = pool.get();
+      internal->minBounds.set(child->minBounds);
+      internal->maxBounds.set(child->maxBounds);
+
+      QuadTreeNode<N> *oldLeaf = pool.get();
+      int oldIdx = getQuadrant(internal, oldBody->pos, oldLeaf->minBounds, oldLeaf->maxBounds);
+      oldLeaf->body = oldBody;
+      internal->quads[oldIdx] = oldLeaf;
+
+      if (__atomic_compare_exchange_n(slot, &child, internal, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        node = internal;
+      } else {
+        pool.unget();
+        pool.unget();
+      }
+    }
+  }
+
+  /**
+   * Computes mass and center of mass of every internal node after
+   * concurrent insertion.
+   */
+  void summarize(QuadTreeNode<N> *node) {
+    for (auto child : node->quads) {
+      if (!child) continue;
+      if (child->isLeaf()) {
+        node->mass += child->body->mass;
+        node->bodyCount += 1;
+        node->massVector.addScaledVector(child->body->pos, child->body->mass);
+      } else {
+        summarize(child);
+        node->mass += child->mass;
+        node->bodyCount += child->bodyCount;
+        node->massVector.add(child->massVector);
+      }
+    }
+  }
+
 public:
   QuadTree() : QuadTree(-1.2, 0.8) {}
-  QuadTree(const double &gravity, const double &theta) : random(1984), _theta(theta), _gravity(gravity) {}
+  QuadTree(const double &gravity, const double &theta, const Kernel &kernel = Kernel()) :
+    random(1984), _theta(theta), _gravity(gravity), _kernel(kernel) {}
+
+  /**
+   * Finds quadrant of the `node` where `pos` belongs to. Bounds of the
+   * quadrant are written into `quadMin` and `quadMax`.
+   */
+  int getQuadrant(const QuadTreeNode<N> *node, const Vector3<N> &pos, Vector3<N> &quadMin, Vector3<N> &quadMax) const {
+    int quadIdx = 0; // Assume we are in the 0's quad.
+    quadMin.set(node->minBounds);
+    quadMax.setMedian(node->minBounds, node->maxBounds);
+
+    for (size_t i = 0; i < N; ++i) {
+      if (pos.coord[i] > quadMax.coord[i]) {
+        quadIdx += (1 << i);
+        auto oldLeft = quadMin.coord[i];
+        quadMin.coord[i] = quadMax.coord[i];
+        quadMax.coord[i] = quadMax.coord[i] + (quadMax.coord[i] - oldLeft);
+      }
+    }
+    return quadIdx;
+  }
 
-  void insertBodies(const std::vector<Body<N> *> &bodies) {
+  /**
+   * Builds the tree from `bodies`. Returns false if some bodies could not be
+   * separated even after retries; the tree is only partially built then.
+   */
+  bool insertBodies(const std::vector<Body<N> *> &bodies) {
     for (int attempt = 0; attempt < 3; ++attempt) {
       try {
         treeNodes.reset();
@@ -276,15 +434,117 @@ public:
         for (size_t i = 1; i < bodies.size(); ++i) {
           insert(bodies[i], root);
         }
-        return; // no need to retry - everything inserted properly.
+        version += 1;
+        return true; // no need to retry - everything inserted properly.
       } catch(NotEnoughQuadSpaceException &e) {
         // well we tried, but some bodies ended up on the same
         // spot, cannot do anything, but hope that next iteration will fix it
       }
     }
-    std::cerr << "Could not insert bodies: Not enought tree precision" << std::endl;
+    // Not enough tree precision.
+    return false;
+  }
+
+  /**
+   * Prepares the tree for concurrent insertion from `threadCount` producers.
+   * Since producers do not know all bodies upfront, caller gives bounds of
+   * the tree. Bodies outside of the bounds are rejected by `insertConcurrent()`.
+   */
+  void beginConcurrentInsert(const Vector3<N> &min, const Vector3<N> &max, size_t threadCount) {
+    treeNodes.reset();
+    root = treeNodes.get();
+    root->minBounds.set(min);
+    root->maxBounds.set(max);
+    squarify(root, 1);
+
+    while (threadNodes.size() < threadCount) {
+      threadNodes.push_back(std::unique_ptr<NodePool<N>>(new NodePool<N>()));
+      threadRandom.push_back(std::unique_ptr<Random>(new Random(1984 + threadRandom.size())));
+    }
+    for (size_t i = 0; i < threadCount; ++i) threadNodes[i]->reset();
+  }
+
+  /**
+   * Inserts a body into the tree. Can be called from many threads at once, as
+   * long as every thread uses its own `threadIndex` in [0, threadCount).
+   *
+   * When the body lands on the same spot as an already inserted one, it is
+   * the new body that gets moved (serial `insert()` moves the old one). Thus
+   * with collisions final positions depend on the order in which threads
+   * arrive, and the tree is equivalent to a serial build only up to that.
+   *
+   * Throws OutOfTreeBoundsException if the body is outside of the bounds given
+   * to `beginConcurrentInsert()`, and NotEnoughQuadSpaceException if the body
+   * could not be separated from a body at the same position.
+   */
+  void insertConcurrent(Body<N> *body, size_t threadIndex) {
+    for (size_t i = 0; i < N; ++i) {
+      double v = body->pos.coord[i];
+      // Negated comparison also rejects NaN.
+      if (!(v >= root->minBounds.coord[i] && v <= root->maxBounds.coord[i])) {
+        OutOfTreeBoundsException _OutOfTreeBoundsException;
+        throw _OutOfTreeBoundsException;
+      }
+    }
+    insertConcurrent(body, root, *threadNodes[threadIndex], *threadRandom[threadIndex]);
+  }
+
+  /**
+   * Finishes concurrent insertion. Must be called after all producers are done
+   * and before forces are computed.
+   */
+  void endConcurrentInsert() {
+    summarize(root);
+    version += 1;
+  }
+
+  /**
+   * Same as `insertBodies()`, but splits insertion between `threadCount` threads.
+   */
+  bool insertBodiesConcurrent(const std::vector<Body<N> *> &bodies, size_t threadCount) {
+    if (threadCount < 2) return insertBodies(bodies);
+
+    for (int attempt = 0; attempt < 3; ++attempt) {
+      treeNodes.reset();
+      QuadTreeNode<N> *bounds = createRootNode(bodies);
+      Vector3<N> min(bounds->minBounds), max(bounds->maxBounds);
+      beginConcurrentInsert(min, max, threadCount);
+
+      std::atomic<bool> failed(false);
+      std::vector<std::thread> threads;
+      for (size_t t = 0; t < threadCount; ++t) {
+        threads.push_back(std::thread([&, t]() {
+          try {
+            for (size_t i = t; i < bodies.size(); i += threadCount) {
+              insertConcurrent(bodies[i], t);
+            }
+          } catch(NotEnoughQuadSpaceException &e) {
+            failed = true;
+          } catch(OutOfTreeBoundsException &e) {
+            // Only possible for NaN coordinates, since bounds come from the bodies.
+            failed = true;
+          }
+        }));
+      }
+      for (auto &thread : threads) thread.join();
+
+      if (!failed) {
+        endConcurrentInsert();
+        return true;
+      }
+    }
+    // Not enough tree precision.
+    return false;
   }
   void updateBodyForce(Body<N> *sourceBody) {
+    sourceBody->force.add(getBodyForce(sourceBody));
+  }
+
+  /**
+   * Computes force which the tree exerts on `sourceBody`, without touching
+   * body's own force accumulator.
+   */
+  Vector3<N> getBodyForce(const Body<N> *sourceBody) const {
     Vector3<N> force;
 
     auto visitNode = [&](const QuadTreeNode<N> *node) -> bool {
@@ -293,11 +553,7 @@ public:
 
       if (node->isLeaf()) {
         Vector3<N> dt = body->pos - sourceBody->pos;
-        auto dist = dt.length();
-        if (dist == 0) {
-          dist = 0.1;
-        }
-        auto v = _gravity * body->mass * sourceBody->mass / (dist * dist * dist);
+        auto v = _kernel(_gravity, sourceBody->mass, body->mass, dt.length());
         force.addScaledVector(dt, v);
 
         return false; // no need to traverse this route;
@@ -313,19 +569,17 @@ public:
 
       Vector3<N> dt = centerOfMass - sourceBody->pos;
       auto distanceToCenterOfMass = dt.length();
-
-      if (distanceToCenterOfMass == 0) {
-        distanceToCenterOfMass = 0.1;
-      }
+      // Clamp is for the ratio only, kernel gets the real distance.
+      auto openingDistance = clampDistance(distanceToCenterOfMass);
 
       auto regionWidth = node->maxBounds.coord[0] - node->minBounds.coord[0];
       // If s / r < θ, treat this entire node as a single body, and calculate the
       // force it exerts on sourceBody. Add this amount to sourceBody's net force.
-      if (regionWidth / distanceToCenterOfMass < _theta) {
+      if (regionWidth / openingDistance < _theta) {
         // in the if statement above we consider node's width only
         // because the region was squarified during tree creation.
         // Thus there is no difference between using width or height.
-        auto v = _gravity * node->mass * sourceBody->mass / (distanceToCenterOfMass * distanceToCenterOfMass * distanceToCenterOfMass);
+        auto v = _kernel(_gravity, sourceBody->mass, node->mass, distanceToCenterOfMass);
         force.addScaledVector(dt, v);
         return false;
       }
@@ -335,8 +589,171 @@ public:
     };
     
     traverse<N>(root, visitNode);
-    
-    sourceBody->force.add(force);
+
+    return force;
+  }
+
+  /**
+   * Computes forces for a packet of up to `P` bodies with a single tree walk.
+   * Node is loaded and tested once for the whole packet: the opening test is
+   * evaluated for every lane into a bit mask, and the walk descends into a node
+   * if any lane needs it. Result is the same as calling `updateBodyForce()` for
+   * each body, but packet works best when bodies are close to each other.
+   *
+   * Lane loops are branch-free: the opening test writes a 0/1 array which is
+   * packed into bits afterwards, and the kernel runs for every lane with its
+   * result multiplied by a 0/1 weight. GCC vectorizes distance, opening test,
+   * kernel and force loops at -O2 and -O3. Distance needs `-fno-math-errno`
+   * (set in common.gypi), otherwise every `sqrt` gets an errno branch. Kernels
+   * which call `exp` (YukawaKernel) stay scalar.
+   *
+   * `stack` is scratch space for the walk. Pass the same one to consecutive
+   * calls, so that the walk does not allocate.
+   */
+  template <size_t P = 4>
+  void updatePacketForce(Body<N> *const *packet, size_t count, PacketStack &stack) const {
+    static_assert(P > 0 && P <= 32, "Packet should have between 1 and 32 lanes");
+    if (!root || count == 0) return;
+    if (count > P) count = P;
+
+    double pos[N][P], force[N][P], mass[P];
+    const Body<N> *source[P];
+    for (size_t lane = 0; lane < P; ++lane) {
+      // unused lanes repeat the first body, and are never active.
+      const Body<N> *body = packet[lane < count ? lane : 0];
+      source[lane] = lane < count ? body : NULL;
+      mass[lane] = body->mass;
+      for (size_t i = 0; i < N; ++i) {
+        pos[i][lane] = body->pos.coord[i];
+        force[i][lane] = 0;
+      }
+    }
+
+    stack.clear();
+    stack.push_back(std::make_pair(root, count == 32 ? ~0u : (1u << count) - 1));
+
+    double dt[N][P], dist[P], opened[P], weight[P], v[P];
+    while (!stack.empty()) {
+      const QuadTreeNode<N> *node = stack.back().first;
+      unsigned mask = stack.back().second;
+      stack.pop_back();
+
+      Vector3<N> center;
+      double nodeMass;
+      if (node->isLeaf()) {
+        center.set(node->body->pos);
+        nodeMass = node->body->mass;
+      } else {
+        center.set(node->massVector);
+        center.multiplyScalar(1./node->mass);
+        nodeMass = node->mass;
+      }
+
+      // Hot lane loops keep `unroll 1`: -O3 fully unrolls short loops before
+      // the vectorizer runs, and their selects turn back into branches. Selects
+      // produce doubles, since mixing int and double types also blocks it.
+      for (size_t lane = 0; lane < P; ++lane) dist[lane] = 0;
+      for (size_t i = 0; i < N; ++i) {
+        #pragma GCC unroll 1
+        for (size_t lane = 0; lane < P; ++lane) {
+          dt[i][lane] = center.coord[i] - pos[i][lane];
+          dist[lane] += dt[i][lane] * dt[i][lane];
+        }
+      }
+      #pragma GCC unroll 1
+      for (size_t lane = 0; lane < P; ++lane) dist[lane] = sqrt(dist[lane]);
+
+      unsigned accept = mask;
+      if (node->isLeaf()) {
+        for (size_t lane = 0; lane < P; ++lane) {
+          if (source[lane] == node->body) accept &= ~(1u << lane);
+        }
+      } else {
+        auto regionWidth = node->maxBounds.coord[0] - node->minBounds.coord[0];
+        #pragma GCC unroll 1
+        for (size_t lane = 0; lane < P; ++lane) {
+          opened[lane] = regionWidth / clampDistance(dist[lane]) < _theta ? 0. : 1.;
+        }
+        unsigned open = 0;
+        for (size_t lane = 0; lane < P; ++lane) open |= (unsigned)opened[lane] << lane;
+        open &= mask;
+        accept &= ~open;
+
+        if (open) {
+          for (size_t q = node->quads.size(); q > 0; --q) {
+            if (node->quads[q - 1]) stack.push_back(std::make_pair(node->quads[q - 1], open));
+          }
+        }
+      }
+
+      if (!accept) continue;
+      // Kernel runs for every lane, and rejected lanes are zeroed by weight.
+      for (size_t lane = 0; lane < P; ++lane) weight[lane] = (accept >> lane) & 1;
+      #pragma GCC unroll 1
+      for (size_t lane = 0; lane < P; ++lane) {
+        v[lane] = _kernel(_gravity, mass[lane], nodeMass, dist[lane]) * weight[lane];
+      }
+      for (size_t i = 0; i < N; ++i) {
+        #pragma GCC unroll 1
+        for (size_t lane = 0; lane < P; ++lane) force[i][lane] += dt[i][lane] * v[lane];
+      }
+    }
+
+    for (size_t lane = 0; lane < count; ++lane) {
+      for (size_t i = 0; i < N; ++i) packet[lane]->force.coord[i] += force[i][lane];
+    }
+  }
+
+  /**
+   * Same as above, but allocates its own scratch stack. Fine for a single
+   * packet; loops should reuse a stack.
+   */
+  template <size_t P = 4>
+  void updatePacketForce(Body<N> *const *packet, size_t count) const {
+    PacketStack stack;
+    updatePacketForce<P>(packet, count, stack);
+  }
+
+  /**
+   * Updates forces of every body in the tree, `P` bodies at a time. Bodies
+   * are grouped in the tree order, so each packet holds spatial neighbors.
+   */
+  template <size_t P = 4>
+  void updateForcesInPackets() {
+    if (!root) return;
+    packetBodies.clear();
+    traverse<N>(root, [&](const QuadTreeNode<N> *node) -> bool {
+      if (node->isLeaf()) packetBodies.push_back(node->body);
+      return !node->isLeaf();
+    });
+
+    for (size_t i = 0; i < packetBodies.size(); i += P) {
+      size_t count = packetBodies.size() - i;
+      updatePacketForce<P>(&packetBodies[i], count < P ? count : P, packetStack);
+    }
+  }
+
+  double getGravity() const {
+    return _gravity;
+  }
+
+  double getTheta() const {
+    return _theta;
+  }
+
+  const Kernel &getKernel() const {
+    return _kernel;
+  }
+
+  void setTheta(double theta) {
+    _theta = theta;
+  }
+
+  /**
+   * Returns a number which changes every time the tree is rebuilt.
+   */
+  size_t getVersion() const {
+    return version;
   }
 
    virtual QuadTreeNode<N>* getRoot() {
@@ -0,0 +1,89 @@
+//
+//  transport.h
+//  layout++
+//
+//  Message passing between processes that share one simulation.
+//
+
+#ifndef __transport_h
+#define __transport_h
+
+#include <vector>
+#include <exception>
+#include <cstddef>
+
+using namespace std;
+
+class TransportException: public exception {};
+
+/**
+ * Point-to-point channel between `getSize()` processes. Messages are arrays
+ * of doubles. Both calls block until the message is fully sent or received.
+ */
+class ITransport {
+public:
+  virtual ~ITransport() {}
+  virtual size_t getRank() const = 0;
+  virtual size_t getSize() const = 0;
+  virtual void send(size_t rank, const std::vector<double> &message) = 0;
+  virtual void receive(size_t rank, std::vector<double> &message) = 0;
+
+  /**
+   * Sends `message` to `rank` and receives its reply into `reply`. Lower rank
+   * sends first, so as long as every process exchanges with its peers in
+   * ascending rank order, exchanges never deadlock.
+   */
+  void exchange(size_t rank, const std::vector<double> &message, std::vector<double> &reply) {
+    if (getRank() < rank) {
+      send(rank, message);
+      receive(rank, reply);
+    } else {
+      receive(rank, reply);
+      send(rank, message);
+    }
+  }
+};
+
+/**
+ * Connects local processes with unix domain sockets.
+ *
+ * Create it in the parent process before fork(), and then call
+ * `useRank()` in every child. Each child should use its own rank. Parent
+ * should `close()` its copy once all children are forked: otherwise a child
+ * which exits early leaves its peers blocked instead of failing.
+ */
+class SocketTransport : public ITransport {
+  size_t rank;
+  size_t size;
+  std::vector<int> sockets; // sockets[i * size + j] is the end which rank `i` uses to talk to `j`
+
+  void closeSocket(size_t idx);
+
+public:
+  SocketTransport(size_t size);
+  ~SocketTransport();
+
+  /**
+   * Makes this transport speak on behalf of `rank`, and closes sockets
+   * which belong to other ranks.
+   */
+  void useRank(size_t rank);
+
+  /**
+   * Closes all sockets of this process.
+   */
+  void close();
+
+  virtual size_t getRank() const {
+    return rank;
+  }
+
+  virtual size_t getSize() const {
+    return size;
+  }
+
+  virtual void send(size_t rank, const std::vector<double> &message);
+  virtual void receive(size_t rank, std::vector<double> &message);
+};
+
+#endif
@@ -0,0 +1,60 @@
+//
+//  capi.cc
+//  layout++
+//
+
+#include "quadtree.cc/capi.h"
+#include "quadtree.cc/batch.h"
+
+struct quadtree_batch {
+  int dimension;
+  BatchForces<2> *planar;
+  BatchForces<3> *spatial;
+};
+
+quadtree_batch *quadtree_batch_create(int dimension, double gravity, double theta) {
+  if (dimension != 2 && dimension != 3) return NULL;
+
+  try {
+    quadtree_batch *batch = new quadtree_batch();
+    batch->dimension = dimension;
+    batch->planar = NULL;
+    batch->spatial = NULL;
+    if (dimension == 2) {
+      batch->planar = new BatchForces<2>(gravity, theta);
+    } else {
+      batch->spatial = new BatchForces<3>(gravity, theta);
+    }
+    return batch;
+  } catch(...) {
+    return NULL;
+  }
+}
+
+void quadtree_batch_destroy(quadtree_batch *batch) {
+  if (!batch) return;
+  delete batch->planar;
+  delete batch->spatial;
+  delete batch;
+}
+
+int quadtree_batch_compute(quadtree_batch *batch, const double *positions, size_t count,
+                           int layout, const double *masses, double *forces) {
+  if (!batch) return QUADTREE_INVALID_ARGUMENT;
+  if (count > 0 && (!positions || !forces)) return QUADTREE_INVALID_ARGUMENT;
+  if (layout != QUADTREE_LAYOUT_INTERLEAVED && layout != QUADTREE_LAYOUT_PER_AXIS) {
+    return QUADTREE_INVALID_ARGUMENT;
+  }
+
+  BufferLayout bufferLayout = layout == QUADTREE_LAYOUT_INTERLEAVED ?
+    BufferLayout::Interleaved : BufferLayout::PerAxis;
+
+  try {
+    bool computed = batch->dimension == 2 ?
+      batch->planar->compute(positions, count, bufferLayout, masses, forces) :
+      batch->spatial->compute(positions, count, bufferLayout, masses, forces);
+    return computed ? QUADTREE_OK : QUADTREE_ERROR;
+  } catch(...) {
+    return QUADTREE_ERROR;
+  }
+}
@@ -0,0 +1,105 @@
+//
+//  transport.cc
+//  layout++
+//
+
+#include "quadtree.cc/transport.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Writing to a socket whose peer is gone raises SIGPIPE, which would kill the
+// process instead of reporting TransportException. Linux can suppress it per
+// call, other systems get SO_NOSIGPIPE on the socket.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace {
+
+void writeAll(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = ::send(fd, data, length, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      throw TransportException();
+    }
+    data += written;
+    length -= written;
+  }
+}
+
+void readAll(int fd, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t received = ::read(fd, data, length);
+    if (received < 0) {
+      if (errno == EINTR) continue;
+      throw TransportException();
+    }
+    if (received == 0) throw TransportException(); // peer is gone
+    data += received;
+    length -= received;
+  }
+}
+
+}
+
+SocketTransport::SocketTransport(size_t _size) : rank(0), size(_size), sockets(_size * _size, -1) {
+  for (size_t i = 0; i < size; ++i) {
+    for (size_t j = i + 1; j < size; ++j) {
+      int pair[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) throw TransportException();
+#ifdef SO_NOSIGPIPE
+      int on = 1;
+      setsockopt(pair[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+      setsockopt(pair[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+      sockets[i * size + j] = pair[0];
+      sockets[j * size + i] = pair[1];
+    }
+  }
+}
+
+SocketTransport::~SocketTransport() {
+  close();
+}
+
+void SocketTransport::closeSocket(size_t idx) {
+  if (sockets[idx] >= 0) {
+    ::close(sockets[idx]);
+    sockets[idx] = -1;
+  }
+}
+
+void SocketTransport::close() {
+  for (size_t i = 0; i < sockets.size(); ++i) closeSocket(i);
+}
+
+void SocketTransport::useRank(size_t _rank) {
+  rank = _rank;
+  for (size_t i = 0; i < size; ++i) {
+    if (i == rank) continue;
+    for (size_t j = 0; j < size; ++j) closeSocket(i * size + j);
+  }
+}
+
+void SocketTransport::send(size_t to, const std::vector<double> &message) {
+  int fd = sockets[rank * size + to];
+  if (fd < 0) throw TransportException();
+
+  uint64_t length = message.size();
+  writeAll(fd, (const char *)&length, sizeof(length));
+  if (length > 0) writeAll(fd, (const char *)&message[0], length * sizeof(double));
+}
+
+void SocketTransport::receive(size_t from, std::vector<double> &message) {
+  int fd = sockets[rank * size + from];
+  if (fd < 0) throw TransportException();
+
+  uint64_t length;
+  readAll(fd, (char *)&length, sizeof(length));
+  message.resize(length);
+  if (length > 0) readAll(fd, (char *)&message[0], length * sizeof(double));
+}
@@ -1,7 +1,17 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
 
+#include <chrono>
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "catch.hpp"
 #include "quadtree.cc/quadtree.h"
+#include "quadtree.cc/batch.h"
+#include "quadtree.cc/capi.h"
+#include "quadtree.cc/lazy.h"
+#include "quadtree.cc/lod.h"
+#include "quadtree.cc/autotune.h"
+#include "quadtree.cc/domain.h"
 
 TEST_CASE( "insert and update update forces", "[insert]" ) {
   QuadTree<3> tree;
@@ -122,4 +132,661 @@ TEST_CASE("It can be two dimensional", "[insert]") {
   REQUIRE(bodyA->force.coord[1] == 0);
   // 'Y-force for body B should be zero'
   REQUIRE(bodyB->force.coord[1] == 0);
-}
\ No newline at end of file
+}
+struct ConstantKernel {
+  double operator()(double, double, double, double) const {
+    return 2;
+  }
+};
+
+TEST_CASE("It can use custom force kernel", "[kernel]") {
+  QuadTree<2, ConstantKernel> tree;
+  std::vector<Body<2> *> bodies;
+  bodies.push_back(new Body<2>());
+  bodies.push_back(new Body<2>());
+  auto bodyA = bodies[0];
+  auto bodyB = bodies[1];
+
+  bodyA->pos.coord[0] = 1; bodyA->pos.coord[1] = 0;
+  bodyB->pos.coord[0] = 4; bodyB->pos.coord[1] = 0;
+
+  tree.insertBodies(bodies);
+  tree.updateBodyForce(bodyA);
+  tree.updateBodyForce(bodyB);
+
+  // force is kernel value times distance vector:
+  REQUIRE(bodyA->force.coord[0] == 6);
+  REQUIRE(bodyB->force.coord[0] == -6);
+}
+
+TEST_CASE("Softened kernel handles bodies at the same location", "[kernel]") {
+  QuadTree<3, SoftenedGravityKernel> tree(-1.2, 0.8, SoftenedGravityKernel(0.5));
+  std::vector<Body<3> *> bodies;
+  bodies.push_back(new Body<3>());
+  bodies.push_back(new Body<3>());
+  auto bodyA = bodies[0];
+  auto bodyB = bodies[1];
+
+  tree.insertBodies(bodies);
+  tree.updateBodyForce(bodyA);
+  tree.updateBodyForce(bodyB);
+
+  REQUIRE(std::isfinite(bodyA->force.coord[0]));
+  REQUIRE(bodyA->force.coord[0] + bodyB->force.coord[0] == Approx(0));
+}
+
+TEST_CASE("Concurrent insertion matches serial build", "[concurrent]") {
+  const int count = 5000;
+  const int threadCount = 4;
+  Random random(42);
+  std::vector<Body<3> *> bodies;
+  for (int i = 0; i < count; ++i) {
+    auto body = new Body<3>();
+    for (int j = 0; j < 3; ++j) body->pos.coord[j] = random.nextDouble() * 1000;
+    bodies.push_back(body);
+  }
+  // make sure we have to deal with collisions too:
+  bodies[1]->pos.set(bodies[0]->pos);
+
+  QuadTree<3> concurrentTree;
+  Vector3<3> min, max;
+  min.set(1000);
+  for (auto body : bodies) {
+    for (int j = 0; j < 3; ++j) {
+      min.coord[j] = std::min(min.coord[j], body->pos.coord[j]);
+      max.coord[j] = std::max(max.coord[j], body->pos.coord[j]);
+    }
+  }
+  concurrentTree.beginConcurrentInsert(min, max, threadCount);
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threadCount; ++t) {
+    producers.push_back(std::thread([&, t]() {
+      for (int i = t; i < count; i += threadCount) concurrentTree.insertConcurrent(bodies[i], t);
+    }));
+  }
+  for (auto &producer : producers) producer.join();
+  concurrentTree.endConcurrentInsert();
+
+  auto root = concurrentTree.getRoot();
+  REQUIRE(root->mass == count);
+
+  std::vector<Vector3<3>> concurrentForces;
+  for (auto body : bodies) {
+    body->force.reset();
+    concurrentTree.updateBodyForce(body);
+    concurrentForces.push_back(body->force);
+  }
+
+  QuadTree<3> serialTree;
+  serialTree.insertBodies(bodies);
+  for (int i = 0; i < count; ++i) {
+    bodies[i]->force.reset();
+    serialTree.updateBodyForce(bodies[i]);
+    for (int j = 0; j < 3; ++j) {
+      REQUIRE(concurrentForces[i].coord[j] == Approx(bodies[i]->force.coord[j]).epsilon(1e-6));
+    }
+  }
+}
+
+TEST_CASE("Concurrent insertion rejects bodies outside of bounds", "[concurrent]") {
+  QuadTree<2> tree;
+  Vector3<2> min, max;
+  max.set(1000);
+  tree.beginConcurrentInsert(min, max, 1);
+
+  Body<2> inside, first, second;
+  inside.pos.set(500);
+  first.pos.coord[0] = 2000;
+  second.pos.coord[0] = 3000;
+
+  tree.insertConcurrent(&inside, 0);
+  REQUIRE_THROWS_AS(tree.insertConcurrent(&first, 0), OutOfTreeBoundsException);
+  REQUIRE_THROWS_AS(tree.insertConcurrent(&second, 0), OutOfTreeBoundsException);
+  tree.endConcurrentInsert();
+
+  REQUIRE(tree.getRoot()->mass == 1);
+}
+
+TEST_CASE("It can insert bodies from many threads", "[concurrent]") {
+  QuadTree<2> tree;
+  std::vector<Body<2> *> bodies;
+  for (int i = 0; i < 1000; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = i % 37;
+    body->pos.coord[1] = i / 37;
+    bodies.push_back(body);
+  }
+
+  tree.insertBodiesConcurrent(bodies, 3);
+
+  int leaves = 0;
+  traverse<2>(tree.getRoot(), [&](const QuadTreeNode<2> *node) -> bool {
+    if (node->isLeaf()) leaves += 1;
+    return true;
+  });
+  REQUIRE(leaves == 1000);
+  REQUIRE(tree.getRoot()->mass == 1000);
+}
+
+TEST_CASE("It can compute forces from flat buffers", "[batch]") {
+  const size_t count = 100;
+  std::vector<double> positions(count * 2), masses(count), forces(count * 2);
+  std::vector<Body<2> *> bodies;
+  for (size_t i = 0; i < count; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = positions[i * 2] = i % 10;
+    body->pos.coord[1] = positions[i * 2 + 1] = i / 10;
+    body->mass = masses[i] = 1 + i % 3;
+    bodies.push_back(body);
+  }
+
+  QuadTree<2> tree;
+  tree.insertBodies(bodies);
+
+  BatchForces<2> batch;
+  batch.compute(&positions[0], count, BufferLayout::Interleaved, &masses[0], &forces[0]);
+
+  for (size_t i = 0; i < count; ++i) {
+    tree.updateBodyForce(bodies[i]);
+    REQUIRE(forces[i * 2] == Approx(bodies[i]->force.coord[0]));
+    REQUIRE(forces[i * 2 + 1] == Approx(bodies[i]->force.coord[1]));
+  }
+}
+
+TEST_CASE("C interface accepts per-axis buffers", "[batch]") {
+  // x coordinates first, then y, then z:
+  double positions[] = { 1, 2,  0, 0,  0, 0 };
+  double forces[6];
+
+  quadtree_batch *batch = quadtree_batch_create(3, -1.2, 0.8);
+  REQUIRE(batch != NULL);
+  int status = quadtree_batch_compute(batch, positions, 2, QUADTREE_LAYOUT_PER_AXIS, NULL, forces);
+  REQUIRE(status == QUADTREE_OK);
+  REQUIRE(forces[0] != 0);
+  REQUIRE(forces[0] + forces[1] == 0);
+  REQUIRE(forces[2] == 0);
+  REQUIRE(forces[5] == 0);
+
+  REQUIRE(quadtree_batch_compute(batch, positions, 2, 42, NULL, forces) == QUADTREE_INVALID_ARGUMENT);
+
+  // These points are closer than the tree can separate:
+  double tooClose[] = { 0, 1e-12,  0, 0,  0, 0 };
+  forces[0] = 42;
+  REQUIRE(quadtree_batch_compute(batch, tooClose, 2, QUADTREE_LAYOUT_PER_AXIS, NULL, forces) == QUADTREE_ERROR);
+  REQUIRE(forces[0] == 42);
+  quadtree_batch_destroy(batch);
+
+  REQUIRE(quadtree_batch_create(4, -1.2, 0.8) == NULL);
+}
+
+TEST_CASE("Lazy forces recompute only what moved", "[lazy]") {
+  QuadTree<2> tree;
+  LazyForces<2> lazy(tree, 0.01, 1e-4);
+  std::vector<Body<2> *> bodies;
+  for (int i = 0; i < 400; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = (i % 20) * 10;
+    body->pos.coord[1] = (i / 20) * 10;
+    bodies.push_back(body);
+  }
+
+  tree.insertBodies(bodies);
+  lazy.update(bodies);
+  REQUIRE(lazy.getRecomputedCount() == 400);
+
+  std::vector<Vector3<2>> firstForces;
+  for (auto body : bodies) {
+    firstForces.push_back(body->force);
+    body->force.reset();
+  }
+
+  // Nothing moved - every force comes from cache:
+  tree.insertBodies(bodies);
+  lazy.update(bodies);
+  REQUIRE(lazy.getRecomputedCount() == 0);
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    auto same = (bodies[i]->force == firstForces[i]);
+    REQUIRE(same);
+    bodies[i]->force.reset();
+  }
+
+  // Move one body inside. It and its neighbors should be updated,
+  // but not the whole graph:
+  bodies[210]->pos.coord[0] += 3;
+  tree.insertBodies(bodies);
+  lazy.update(bodies);
+  auto recomputed = lazy.getRecomputedCount();
+  REQUIRE(recomputed > 1);
+  REQUIRE(recomputed < 400);
+
+  for (auto body : bodies) {
+    auto exact = tree.getBodyForce(body);
+    for (int j = 0; j < 2; ++j) {
+      REQUIRE(body->force.coord[j] == Approx(exact.coord[j]).margin(1e-4));
+    }
+  }
+}
+
+template <typename Kernel>
+double getWorstLazyError(double theta) {
+  QuadTree<2, Kernel> tree(-1.2, theta);
+  LazyForces<2, Kernel> lazy(tree, 0.01, 1e-3);
+  std::vector<Body<2> *> bodies;
+  for (int i = 0; i < 400; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = (i % 20) * 10;
+    body->pos.coord[1] = (i / 20) * 10;
+    bodies.push_back(body);
+  }
+  tree.insertBodies(bodies);
+  lazy.update(bodies);
+
+  bodies[42]->pos.coord[0] += 5;
+  bodies[317]->pos.coord[1] += 5;
+  for (auto body : bodies) body->force.reset();
+  tree.insertBodies(bodies);
+  lazy.update(bodies);
+
+  double worst = 0;
+  for (auto body : bodies) {
+    Vector3<2> diff = body->force - tree.getBodyForce(body);
+    worst = std::max(worst, diff.length());
+  }
+  return worst;
+}
+
+TEST_CASE("Lazy forces stay within tolerance for every kernel", "[lazy]") {
+  for (double theta : {0., 0.8}) {
+    REQUIRE(getWorstLazyError<GravityKernel>(theta) <= 1e-3);
+    REQUIRE(getWorstLazyError<LogKernel>(theta) <= 1e-3);
+    REQUIRE(getWorstLazyError<SoftenedGravityKernel>(theta) <= 1e-3);
+    REQUIRE(getWorstLazyError<YukawaKernel>(theta) <= 1e-3);
+    REQUIRE(getWorstLazyError<CutoffGravityKernel>(theta) <= 1e-3);
+  }
+}
+
+TEST_CASE("Lazy forces follow changes of approximation", "[lazy]") {
+  QuadTree<2, LogKernel> tree(-1.2, 0.8);
+  LazyForces<2, LogKernel> lazy(tree, 0.01, 1e-3);
+  Random random(7);
+  std::vector<Body<2> *> bodies;
+  for (int i = 0; i < 2000; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = 10 + random.nextDouble() * 980;
+    body->pos.coord[1] = 10 + random.nextDouble() * 980;
+    bodies.push_back(body);
+  }
+  // Corners keep the root bounds, so caches survive between steps:
+  bodies[0]->pos.set(0);
+  bodies[1]->pos.set(1000);
+
+  size_t recomputed = 0;
+  for (int step = 0; step < 20; ++step) {
+    for (auto body : bodies) body->force.reset();
+    tree.insertBodies(bodies);
+    lazy.update(bodies);
+    if (step > 0) recomputed += lazy.getRecomputedCount();
+
+    for (auto body : bodies) {
+      Vector3<2> diff = body->force - tree.getBodyForce(body);
+      REQUIRE(diff.length() <= 1e-3);
+    }
+
+    // One body moves far enough to cross quadrants of the tree:
+    auto body = bodies[2 + (step * 97) % 1998];
+    body->pos.coord[0] += 5;
+    body->pos.coord[1] -= 3;
+  }
+  // Most caches survive:
+  REQUIRE(recomputed < 19 * 2000 / 4);
+}
+
+TEST_CASE("It can extract clusters for a view", "[lod]") {
+  QuadTree<2> tree;
+  std::vector<Body<2> *> bodies;
+  for (int i = 0; i < 1024; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = (i % 32) * 10 + 1;
+    body->pos.coord[1] = (i / 32) * 10 + 1;
+    bodies.push_back(body);
+  }
+  tree.insertBodies(bodies);
+
+  Vector3<2> viewMin, viewMax;
+  viewMin.set(-1000);
+  viewMax.set(1000);
+
+  LevelOfDetail<2> lod(tree);
+  // Whole tree fits into a pixel:
+  auto &coarse = lod.extract(viewMin, viewMax, 0.001, 1);
+  REQUIRE(coarse.size() == 1);
+  REQUIRE(coarse[0].bodyCount == 1024);
+  REQUIRE(coarse[0].mass == 1024);
+
+  // Every body is visible on its own:
+  auto &fine = lod.extract(viewMin, viewMax, 100, 1);
+  REQUIRE(fine.size() == 1024);
+
+  auto &medium = lod.extract(viewMin, viewMax, 1, 50);
+  size_t totalCount = 0;
+  for (auto &cluster : medium) totalCount += cluster.bodyCount;
+  REQUIRE(medium.size() > 1);
+  REQUIRE(medium.size() < 1024);
+  REQUIRE(totalCount == 1024);
+}
+
+TEST_CASE("Panning the view extracts the same clusters as a fresh walk", "[lod]") {
+  QuadTree<2> tree;
+  std::vector<Body<2> *> bodies;
+  Random random(7);
+  for (int i = 0; i < 2000; ++i) {
+    auto body = new Body<2>();
+    body->pos.coord[0] = random.nextDouble() * 1000;
+    body->pos.coord[1] = random.nextDouble() * 1000;
+    bodies.push_back(body);
+  }
+  tree.insertBodies(bodies);
+
+  LevelOfDetail<2> panning(tree);
+  Vector3<2> viewMin, viewMax;
+  viewMin.set(100);
+  viewMax.set(400);
+  panning.extract(viewMin, viewMax, 2, 30);
+
+  viewMin.coord[0] += 70; viewMax.coord[0] += 70;
+  viewMin.coord[1] -= 20; viewMax.coord[1] -= 20;
+  auto panned = panning.extract(viewMin, viewMax, 2, 30);
+
+  LevelOfDetail<2> fresh(tree);
+  auto expected = fresh.extract(viewMin, viewMax, 2, 30);
+
+  REQUIRE(panned.size() == expected.size());
+  double pannedMass = 0, expectedMass = 0;
+  for (auto &cluster : panned) pannedMass += cluster.mass * cluster.center.coord[0];
+  for (auto &cluster : expected) expectedMass += cluster.mass * cluster.center.coord[0];
+  REQUIRE(pannedMass == Approx(expectedMass));
+}
+
+template <size_t N>
+std::vector<Body<N> *> createClusteredBodies(int count, int clustersCount) {
+  Random random(31);
+  std::vector<Body<N> *> bodies;
+  std::vector<Vector3<N>> centers(clustersCount);
+  for (auto &center : centers) {
+    for (size_t j = 0; j < N; ++j) center.coord[j] = random.nextDouble() * 10000;
+  }
+  for (int i = 0; i < count; ++i) {
+    auto body = new Body<N>();
+    body->pos.set(centers[i % clustersCount]);
+    for (size_t j = 0; j < N; ++j) body->pos.coord[j] += (random.nextDouble() - 0.5) * 200;
+    bodies.push_back(body);
+  }
+  return bodies;
+}
+
+template <size_t N, size_t P, typename Kernel = GravityKernel>
+void requirePacketsMatchSingleBodies() {
+  auto bodies = createClusteredBodies<N>(3000, 12);
+  QuadTree<N, Kernel> tree;
+  tree.insertBodies(bodies);
+
+  std::vector<Vector3<N>> expected;
+  for (auto body : bodies) expected.push_back(tree.getBodyForce(body));
+
+  tree.template updateForcesInPackets<P>();
+  for (size_t i = 0; i < bodies.size(); ++i) {
+    for (size_t j = 0; j < N; ++j) {
+      REQUIRE(bodies[i]->force.coord[j] == Approx(expected[i].coord[j]));
+    }
+  }
+}
+
+TEST_CASE("Packet traversal matches single body traversal", "[packet]") {
+  requirePacketsMatchSingleBodies<2, 4>();
+  requirePacketsMatchSingleBodies<2, 8>();
+  requirePacketsMatchSingleBodies<3, 4>();
+  requirePacketsMatchSingleBodies<3, 8>();
+  requirePacketsMatchSingleBodies<2, 4, CutoffGravityKernel>();
+  requirePacketsMatchSingleBodies<3, 8, SoftenedGravityKernel>();
+}
+
+template <size_t N, size_t P>
+double timePackets(QuadTree<N> &tree) {
+  auto start = std::chrono::steady_clock::now();
+  tree.template updateForcesInPackets<P>();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <size_t N>
+void comparePacketSpeed() {
+  auto bodies = createClusteredBodies<N>(200000, 40);
+  QuadTree<N> tree;
+  tree.insertBodies(bodies);
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto body : bodies) tree.updateBodyForce(body);
+  auto single = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  // One lane packets use the same explicit stack walk, so they are the fair
+  // baseline for packetization itself:
+  std::cout << N << "D: updateBodyForce " << single << "ms"
+    << ", 1 lane " << timePackets<N, 1>(tree) << "ms"
+    << ", 4 lanes " << timePackets<N, 4>(tree) << "ms"
+    << ", 8 lanes " << timePackets<N, 8>(tree) << "ms" << std::endl;
+}
+
+TEST_CASE("Packet traversal speed", "[.][benchmark]") {
+  comparePacketSpeed<2>();
+  comparePacketSpeed<3>();
+}
+
+TEST_CASE("Auto tuner locks configuration within error budget", "[autotune]") {
+  auto bodies = createClusteredBodies<2>(4000, 8);
+  AutoTuner<2> tuner(-1.2, 0.01, GravityKernel(), 4);
+
+  int steps = 0;
+  while (!tuner.isTuned() && steps < 20) {
+    for (auto body : bodies) body->force.reset();
+    tuner.step(bodies);
+    steps += 1;
+  }
+  REQUIRE(tuner.isTuned());
+  REQUIRE(tuner.getMeasuredError() <= 0.01);
+
+  // Tuned configuration gives the same forces as a plain tree with the same theta:
+  auto config = tuner.getConfig();
+  for (auto body : bodies) body->force.reset();
+  tuner.step(bodies);
+
+  QuadTree<2> tree(-1.2, config.theta);
+  tree.insertBodies(bodies);
+  for (size_t i = 0; i < bodies.size(); i += 97) {
+    auto expected = tree.getBodyForce(bodies[i]);
+    REQUIRE(bodies[i]->force.coord[0] == Approx(expected.coord[0]).epsilon(0.01).margin(1e-6));
+    REQUIRE(bodies[i]->force.coord[1] == Approx(expected.coord[1]).epsilon(0.01).margin(1e-6));
+  }
+
+  // Tighter budget requires more precise theta:
+  AutoTuner<2> strictTuner(-1.2, 0.0001, GravityKernel(), 1);
+  strictTuner.step(bodies);
+  REQUIRE(strictTuner.getConfig().theta < config.theta);
+
+  // Budget below what the tree can do falls back to exact forces:
+  AutoTuner<2> exactTuner(-1.2, 1e-9, GravityKernel(), 1);
+  exactTuner.step(bodies);
+  REQUIRE(exactTuner.getConfig().theta == 0);
+  REQUIRE(exactTuner.isBudgetMet());
+
+  // Budget nothing can meet is reported:
+  AutoTuner<2> impossibleTuner(-1.2, -1, GravityKernel(), 1);
+  impossibleTuner.step(bodies);
+  REQUIRE(!impossibleTuner.isBudgetMet());
+
+  // Significant growth of the graph starts tuning over:
+  auto more = createClusteredBodies<2>(10000, 8);
+  tuner.step(more);
+  REQUIRE(!tuner.isTuned());
+}
+
+TEST_CASE("Auto tuner does not tune on partial trees", "[autotune]") {
+  auto bodies = createClusteredBodies<2>(2000, 8);
+  Vector3<2> spot(bodies[0]->pos);
+  AutoTuner<2> tuner(-1.2, 0.01, GravityKernel(), 4);
+
+  for (int step = 0; step < 12; ++step) {
+    // Insertion bumps coinciding bodies, so they are put back every step.
+    // Tree runs out of precision separating that many of them:
+    for (int i = 0; i < 100; ++i) bodies[i]->pos.set(spot);
+    for (auto body : bodies) body->force.reset();
+
+    REQUIRE(!tuner.step(bodies));
+    for (auto body : bodies) {
+      REQUIRE(body->force.coord[0] == 0);
+      REQUIRE(body->force.coord[1] == 0);
+    }
+    REQUIRE(!tuner.isTuned());
+  }
+
+  // Once bodies can be separated, tuning proceeds:
+  for (int i = 0; i < 100; ++i) bodies[i]->pos.coord[0] += i;
+  REQUIRE(tuner.step(bodies));
+  REQUIRE(tuner.isBudgetMet());
+}
+
+TEST_CASE("Domain decomposition matches single process", "[domain]") {
+  const size_t processes = 3;
+  const double theta = 0.5;
+  auto bodies = createClusteredBodies<3>(6000, 10);
+  auto owners = partitionBodies<3>(bodies, processes);
+
+  QuadTree<3> tree(-1.2, theta);
+  tree.insertBodies(bodies);
+  std::vector<Vector3<3>> expected;
+  for (auto body : bodies) expected.push_back(tree.getBodyForce(body));
+
+  SocketTransport transport(processes);
+  std::vector<int> results(processes);
+  std::vector<pid_t> children(processes);
+  for (size_t rank = 0; rank < processes; ++rank) {
+    int pipeFds[2];
+    REQUIRE(pipe(pipeFds) == 0);
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+
+    if (pid == 0) {
+      // Worker process: compute forces for own bodies, and report them to the parent.
+      close(pipeFds[0]);
+      transport.useRank(rank);
+      std::vector<Body<3> *> local;
+      for (size_t i = 0; i < bodies.size(); ++i) {
+        if (owners[i] == rank) local.push_back(bodies[i]);
+      }
+      try {
+        DomainDecomposition<3> domain(transport, -1.2, theta);
+        if (!domain.step(local)) _exit(1);
+      } catch(...) {
+        _exit(1);
+      }
+      for (size_t i = 0; i < bodies.size(); ++i) {
+        if (owners[i] != rank) continue;
+        if (write(pipeFds[1], bodies[i]->force.coord, sizeof(double) * 3) != sizeof(double) * 3) _exit(1);
+      }
+      _exit(0);
+    }
+
+    close(pipeFds[1]);
+    results[rank] = pipeFds[0];
+    children[rank] = pid;
+  }
+  // Otherwise a worker that exits early leaves its peers waiting forever:
+  transport.close();
+
+  double errorSum = 0, expectedSum = 0;
+  for (size_t rank = 0; rank < processes; ++rank) {
+    for (size_t i = 0; i < bodies.size(); ++i) {
+      if (owners[i] != rank) continue;
+      Vector3<3> force;
+      REQUIRE(read(results[rank], force.coord, sizeof(double) * 3) == sizeof(double) * 3);
+      Vector3<3> diff = force - expected[i];
+      errorSum += diff.length() * diff.length();
+      expectedSum += expected[i].length() * expected[i].length();
+    }
+    close(results[rank]);
+
+    int status;
+    waitpid(children[rank], &status, 0);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+  }
+
+  REQUIRE(std::sqrt(errorSum / expectedSum) < 0.01);
+}
+
+TEST_CASE("Failed build on one process stops every process", "[domain]") {
+  const size_t processes = 2;
+  std::vector<Body<2> *> bodies;
+  for (int i = 0; i < 100; ++i) {
+    // First process gets coincident bodies, its tree cannot be built:
+    auto body = new Body<2>();
+    body->pos.coord[0] = body->pos.coord[1] = i < 50 ? 0 : i;
+    bodies.push_back(body);
+  }
+
+  SocketTransport transport(processes);
+  std::vector<pid_t> children(processes);
+  for (size_t rank = 0; rank < processes; ++rank) {
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+
+    if (pid == 0) {
+      transport.useRank(rank);
+      std::vector<Body<2> *> local(bodies.begin() + rank * 50, bodies.begin() + (rank + 1) * 50);
+      try {
+        DomainDecomposition<2> domain(transport, -1.2, 0.5);
+        if (domain.step(local)) _exit(0);
+        for (auto body : local) {
+          if (body->force.coord[0] != 0 || body->force.coord[1] != 0) _exit(1);
+        }
+        _exit(2);
+      } catch(...) {
+        _exit(1);
+      }
+    }
+    children[rank] = pid;
+  }
+  transport.close();
+
+  for (size_t rank = 0; rank < processes; ++rank) {
+    int status;
+    waitpid(children[rank], &status, 0);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 2);
+  }
+
+  for (auto body : bodies) delete body;
+}
+
+TEST_CASE("Sending to a dead process throws", "[domain]") {
+  SocketTransport transport(2);
+  pid_t pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    transport.useRank(1);
+    _exit(0);
+  }
+
+  transport.useRank(0);
+  int status;
+  waitpid(pid, &status, 0);
+
+  std::vector<double> message(100000, 1.0);
+  REQUIRE_THROWS_AS(transport.send(1, message), TransportException);
+}
+
+TEST_CASE("Bodies are partitioned into equal space filling curve ranges", "[domain]") {
+  auto bodies = createClusteredBodies<2>(1000, 4);
+  auto owners = partitionBodies<2>(bodies, 4);
+  std::vector<size_t> counts(4, 0);
+  for (auto owner : owners) counts[owner] += 1;
+  for (auto count : counts) REQUIRE(count == 250);
+}